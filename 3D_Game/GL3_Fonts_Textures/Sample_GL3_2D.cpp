@@ -2,6 +2,16 @@
 #include <cmath>
 #include <fstream>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include <deque>
+#include <iomanip>
+#include <climits>
 
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
@@ -9,11 +19,23 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include <glad/glad.h>
-#include <FTGL/ftgl.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
 #include <GLFW/glfw3.h>
 #include <SOIL/SOIL.h>
 
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
 #include <math.h>
 #include <sstream>
 
@@ -24,324 +46,3583 @@ double mos_x, mos_y;
 
 using namespace std;
 
+/********************
+ * Allocation Audit *
+ ********************/
+
+/* Built with -DALLOC_AUDIT (make sample2D_audit) the global operator new
+   reports every allocation made inside ALLOC_AUDIT_FRAME scopes, which cover
+   the steady state frame of the render and main threads, the simulation
+   ticks of a settled level and the jobs they run. The first reports come
+   with a backtrace, main() prints the totals */
+
+#ifdef ALLOC_AUDIT
+
+#include <execinfo.h>
+
+#define ALLOC_AUDIT_REPORTS 8
+
+thread_local int alloc_audit_depth = 0; // > 0 inside an audited scope
+thread_local bool alloc_audit_reporting = false;
+std::atomic<long> audit_allocations(0);
+std::atomic<long> audit_bytes(0);
+
+void auditAllocation (size_t size)
+{
+	if (alloc_audit_depth == 0 || alloc_audit_reporting)
+		return;
+	long n = audit_allocations++;
+	audit_bytes += size;
+	if (n < ALLOC_AUDIT_REPORTS) {
+		// stdio and backtrace_symbols_fd() use malloc, never operator new
+		alloc_audit_reporting = true;
+		void* frames[32];
+		int count = backtrace(frames, 32);
+		fprintf(stderr, "Allocation of %lu bytes on the frame path:\n", (unsigned long)size);
+		backtrace_symbols_fd(frames, count, 2);
+		alloc_audit_reporting = false;
+	}
+}
+
+void* operator new (size_t size)
+{
+	auditAllocation(size);
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[] (size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete (void* p) noexcept { free(p); }
+void operator delete[] (void* p) noexcept { free(p); }
+void operator delete (void* p, size_t) noexcept { free(p); }
+void operator delete[] (void* p, size_t) noexcept { free(p); }
+
+struct AllocAuditScope {
+	bool enabled;
+	AllocAuditScope (bool enable) : enabled(enable) { if (enabled) alloc_audit_depth++; }
+	~AllocAuditScope () { if (enabled) alloc_audit_depth--; }
+};
+#define ALLOC_AUDIT_FRAME(enable) AllocAuditScope alloc_audit_scope(enable)
+
+void allocAuditReport ()
+{
+	cout << "Allocation audit: " << audit_allocations << " allocations, " << audit_bytes << " bytes on the steady state frame path" << endl;
+}
+
+#else
+#define ALLOC_AUDIT_FRAME(enable)
+#endif
+
+
+/**********
+ * Logger *
+ **********/
+
+/* logPrint() formats its line straight into the next slot of a bounded lock
+   free ring (a sequence number per slot, so any thread can write and only
+   the writer thread reads) and returns. It never locks, allocates or
+   touches a file; when the ring is full the line is dropped and counted
+   instead of waiting. The writer thread drains the ring in order every few
+   milliseconds and writes the lines in one batch. Lines below log_level
+   (--log-level) are skipped before they are formatted */
+
+enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_LEVEL_COUNT };
+const char* log_level_names[LOG_LEVEL_COUNT] = { "debug", "info", "warn", "error" };
+const char log_level_letters[LOG_LEVEL_COUNT] = { 'D', 'I', 'W', 'E' };
+
+#define LOG_SLOTS 4096 // a power of two
+#define LOG_TEXT_SIZE 240
+#define LOG_WRITE_PERIOD 2 // ms between batches
+
+struct LogSlot {
+	std::atomic<unsigned long> sequence; // position it can be written at, +1 once written
+	long long time;
+	int level;
+	char text[LOG_TEXT_SIZE];
+};
+
+struct Logger {
+	LogSlot slots[LOG_SLOTS];
+	std::atomic<unsigned long> head; // next position to claim
+	unsigned long tail; // next position to write out, writer thread only
+	std::atomic<unsigned long> written; // lines written out, for logFlush()
+	std::atomic<long> dropped;
+	std::atomic<bool> running;
+	std::thread writer;
+	FILE* sink;
+	long long epoch;
+} logger;
+
+std::atomic<int> log_level(LOG_INFO);
+
+long long nowNanos ();
+
+void logPrint (int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void logPrint (int level, const char* format, ...)
+{
+	if (level < log_level)
+		return;
+
+	unsigned long position = logger.head.load(std::memory_order_relaxed);
+	LogSlot* slot;
+	for (;;) {
+		slot = &logger.slots[position & (LOG_SLOTS - 1)];
+		long lag = (long)(slot->sequence.load(std::memory_order_acquire) - position);
+		if (lag == 0) {
+			if (logger.head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				break;
+		}
+		else if (lag < 0) {
+			// The writer has not got to this slot's previous line yet
+			logger.dropped++;
+			return;
+		}
+		else
+			position = logger.head.load(std::memory_order_relaxed);
+	}
+
+	slot->time = nowNanos();
+	slot->level = level;
+	va_list args;
+	va_start(args, format);
+	vsnprintf(slot->text, LOG_TEXT_SIZE, format, args);
+	va_end(args);
+	slot->sequence.store(position + 1, std::memory_order_release);
+}
+
+/* A line each, for compiler logs and the like; empty lines are left out */
+void logLines (int level, const char* text)
+{
+	while (*text) {
+		const char* end = strchr(text, '\n');
+		int length = end ? end - text : strlen(text);
+		if (length > 0)
+			logPrint(level, "%.*s", length, text);
+		text += length + (end ? 1 : 0);
+	}
+}
+
+void logWriterThread ()
+{
+	static char batch[64*1024];
+	long reported_drops = 0;
+	for (;;) {
+		bool stopping = !logger.running;
+		size_t length = 0;
+		for (;;) {
+			LogSlot& slot = logger.slots[logger.tail & (LOG_SLOTS - 1)];
+			if (slot.sequence.load(std::memory_order_acquire) != logger.tail + 1)
+				break;
+			if (length + LOG_TEXT_SIZE + 64 > sizeof(batch)) {
+				fwrite(batch, 1, length, logger.sink);
+				length = 0;
+			}
+			length += snprintf(batch + length, sizeof(batch) - length, "%10.3f %c %s\n",
+				(slot.time - logger.epoch) / 1e9, log_level_letters[slot.level], slot.text);
+			slot.sequence.store(logger.tail + LOG_SLOTS, std::memory_order_release);
+			logger.tail++;
+		}
+		long dropped = logger.dropped;
+		if (dropped != reported_drops) {
+			length += snprintf(batch + length, sizeof(batch) - length, "%10.3f W %ld log lines dropped, the ring was full\n",
+				(nowNanos() - logger.epoch) / 1e9, dropped - reported_drops);
+			reported_drops = dropped;
+		}
+		if (length) {
+			fwrite(batch, 1, length, logger.sink);
+			fflush(logger.sink);
+		}
+		logger.written = logger.tail;
+		if (stopping)
+			break;
+		std::this_thread::sleep_for(std::chrono::milliseconds(LOG_WRITE_PERIOD));
+	}
+}
+
+/* Block until every line logged so far is written, before printing to
+   stdout directly */
+void logFlush ()
+{
+	unsigned long target = logger.head;
+	while (logger.running && logger.written < target)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+/* Writes out what is left and stops the writer, also on exit() */
+void logShutdown ()
+{
+	if (!logger.running.exchange(false))
+		return;
+	logger.writer.join();
+	if (logger.sink != stdout)
+		fclose(logger.sink);
+}
+
+/* Lines go to path, or stdout when it is NULL or cannot be opened */
+void logInit (const char* path)
+{
+	for (int i=0; i<LOG_SLOTS; i++)
+		logger.slots[i].sequence = i;
+	logger.epoch = nowNanos();
+	logger.sink = path ? fopen(path, "w") : NULL;
+	if (!logger.sink) {
+		if (path)
+			cout << "Could not open log " << path << ", logging to stdout" << endl;
+		logger.sink = stdout;
+	}
+	logger.running = true;
+	logger.writer = std::thread(logWriterThread);
+	atexit(logShutdown);
+}
+
+
+/******************
+ * GL Call Counts *
+ ******************/
+
+/* Built with -DGL_CALL_STATS (make sample2D_glstats) the GL entry points below
+   go through wrappers that count calls, uploaded bytes and binds that really
+   change state. Counters are kept per frame with min/avg/max over the last
+   GL_STATS_FRAMES frames; F3 prints them. Without the define nothing changes */
+
+#ifdef GL_CALL_STATS
+
+#define GL_STATS_FRAMES 120
+
+enum GLStatsCall { CALL_DRAW_ARRAYS, CALL_DRAW_ARRAYS_INSTANCED, CALL_UNIFORM_MATRIX, CALL_BIND_VERTEX_ARRAY, CALL_BIND_BUFFER, CALL_POLYGON_MODE, CALL_BUFFER_DATA, CALL_BUFFER_SUB_DATA, CALL_BIND_TEXTURE, CALL_COUNT };
+const char* gl_stats_names[CALL_COUNT] = { "glDrawArrays", "glDrawArraysInstanced", "glUniformMatrix4fv", "glBindVertexArray", "glBindBuffer", "glPolygonMode", "glBufferData", "glBufferSubData", "glBindTexture" };
+
+struct GLFrameStats {
+	unsigned int calls[CALL_COUNT];
+	unsigned int changes[CALL_COUNT]; // calls that changed the bound object or mode
+	unsigned long long bytes; // uploaded with glBufferData and glBufferSubData or written to the stream buffer
+	unsigned long long vertices; // submitted with glDrawArrays and glDrawArraysInstanced, every instance counted
+};
+
+struct GLStats {
+	GLFrameStats frame;
+	GLFrameStats history[GL_STATS_FRAMES];
+	int history_count, history_next;
+	unsigned long frames;
+
+	GLuint vertex_array;
+	GLuint buffers[4]; // array, element array, pixel unpack, everything else
+	GLuint texture;
+	GLenum polygon_mode;
+} gl_stats;
+
+std::atomic<bool> dump_gl_stats(false);
+
+int glStatsBufferSlot (GLenum target)
+{
+	switch (target) {
+		case GL_ARRAY_BUFFER: return 0;
+		case GL_ELEMENT_ARRAY_BUFFER: return 1;
+		case GL_PIXEL_UNPACK_BUFFER: return 2;
+		default: return 3;
+	}
+}
+
+inline void statsDrawArrays (GLenum mode, GLint first, GLsizei count)
+{
+	gl_stats.frame.calls[CALL_DRAW_ARRAYS]++;
+	gl_stats.frame.vertices += count;
+	glDrawArrays(mode, first, count);
+}
+
+inline void statsDrawArraysInstanced (GLenum mode, GLint first, GLsizei count, GLsizei instances)
+{
+	gl_stats.frame.calls[CALL_DRAW_ARRAYS_INSTANCED]++;
+	gl_stats.frame.vertices += (unsigned long long)count*instances;
+	glDrawArraysInstanced(mode, first, count, instances);
+}
+
+inline void statsUniformMatrix4fv (GLint location, GLsizei count, GLboolean transpose, const GLfloat* value)
+{
+	gl_stats.frame.calls[CALL_UNIFORM_MATRIX]++;
+	gl_stats.frame.changes[CALL_UNIFORM_MATRIX]++;
+	glUniformMatrix4fv(location, count, transpose, value);
+}
+
+inline void statsBindVertexArray (GLuint array)
+{
+	gl_stats.frame.calls[CALL_BIND_VERTEX_ARRAY]++;
+	if (array != gl_stats.vertex_array)
+		gl_stats.frame.changes[CALL_BIND_VERTEX_ARRAY]++;
+	gl_stats.vertex_array = array;
+	glBindVertexArray(array);
+}
+
+inline void statsBindBuffer (GLenum target, GLuint buffer)
+{
+	GLuint& bound = gl_stats.buffers[glStatsBufferSlot(target)];
+	gl_stats.frame.calls[CALL_BIND_BUFFER]++;
+	if (buffer != bound)
+		gl_stats.frame.changes[CALL_BIND_BUFFER]++;
+	bound = buffer;
+	glBindBuffer(target, buffer);
+}
+
+inline void statsPolygonMode (GLenum face, GLenum mode)
+{
+	gl_stats.frame.calls[CALL_POLYGON_MODE]++;
+	if (mode != gl_stats.polygon_mode)
+		gl_stats.frame.changes[CALL_POLYGON_MODE]++;
+	gl_stats.polygon_mode = mode;
+	glPolygonMode(face, mode);
+}
+
+inline void statsBufferData (GLenum target, GLsizeiptr size, const void* data, GLenum usage)
+{
+	gl_stats.frame.calls[CALL_BUFFER_DATA]++;
+	gl_stats.frame.changes[CALL_BUFFER_DATA]++;
+	gl_stats.frame.bytes += size;
+	glBufferData(target, size, data, usage);
+}
+
+inline void statsBufferSubData (GLenum target, GLintptr offset, GLsizeiptr size, const void* data)
+{
+	gl_stats.frame.calls[CALL_BUFFER_SUB_DATA]++;
+	gl_stats.frame.changes[CALL_BUFFER_SUB_DATA]++;
+	gl_stats.frame.bytes += size;
+	glBufferSubData(target, offset, size, data);
+}
+
+inline void statsBindTexture (GLenum target, GLuint texture)
+{
+	gl_stats.frame.calls[CALL_BIND_TEXTURE]++;
+	if (texture != gl_stats.texture)
+		gl_stats.frame.changes[CALL_BIND_TEXTURE]++;
+	gl_stats.texture = texture;
+	glBindTexture(target, texture);
+}
+
+#undef glDrawArrays
+#undef glDrawArraysInstanced
+#undef glUniformMatrix4fv
+#undef glBindVertexArray
+#undef glBindBuffer
+#undef glPolygonMode
+#undef glBufferData
+#undef glBufferSubData
+#undef glBindTexture
+#define glDrawArrays statsDrawArrays
+#define glDrawArraysInstanced statsDrawArraysInstanced
+#define glUniformMatrix4fv statsUniformMatrix4fv
+#define glBindVertexArray statsBindVertexArray
+#define glBindBuffer statsBindBuffer
+#define glPolygonMode statsPolygonMode
+#define glBufferData statsBufferData
+#define glBufferSubData statsBufferSubData
+#define glBindTexture statsBindTexture
+
+/* Render thread, once per frame after the swap */
+void glStatsEndFrame ()
+{
+	gl_stats.history[gl_stats.history_next] = gl_stats.frame;
+	gl_stats.history_next = (gl_stats.history_next + 1) % GL_STATS_FRAMES;
+	gl_stats.history_count = min(gl_stats.history_count + 1, GL_STATS_FRAMES);
+	gl_stats.frames++;
+	memset(&gl_stats.frame, 0, sizeof(gl_stats.frame));
+}
+
+void glStatsDump ()
+{
+	int n = gl_stats.history_count;
+	if (n == 0)
+		return;
+	const GLFrameStats& last = gl_stats.history[(gl_stats.history_next + GL_STATS_FRAMES - 1) % GL_STATS_FRAMES];
+
+	logPrint(LOG_INFO, "GL calls per frame, frame %ld, last %d frames", gl_stats.frames, n);
+	logPrint(LOG_INFO, "call                  last   min    avg    max  changes(avg)");
+	for (int c=0; c<CALL_COUNT; c++) {
+		unsigned int lo = ~0u, hi = 0;
+		double sum = 0, changes = 0;
+		for (int i=0; i<n; i++) {
+			lo = min(lo, gl_stats.history[i].calls[c]);
+			hi = max(hi, gl_stats.history[i].calls[c]);
+			sum += gl_stats.history[i].calls[c];
+			changes += gl_stats.history[i].changes[c];
+		}
+		logPrint(LOG_INFO, "%-20s%6u%6u%8.1f%6u%12.1f", gl_stats_names[c], last.calls[c], lo, sum/n, hi, changes/n);
+	}
+
+	double bytes = 0, vertices = 0;
+	for (int i=0; i<n; i++) {
+		bytes += gl_stats.history[i].bytes;
+		vertices += gl_stats.history[i].vertices;
+	}
+	logPrint(LOG_INFO, "uploaded %lld bytes last frame, %g avg", (long long)last.bytes, bytes/n);
+	logPrint(LOG_INFO, "vertices %lld last frame, %g avg", (long long)last.vertices, vertices/n);
+}
+
+#endif
+
+
+/**********
+ * Arenas *
+ **********/
+
+/* Linear allocator for data that lives exactly as long as a level. Memory is
+   handed out from 64 KB blocks by bumping an offset and is only given back
+   all at once by arenaReset(), which returns the blocks to a shared pool so
+   the next level reuses them. Nothing is destructed, so only trivially
+   destructible types go in an arena */
+
+#define ARENA_BLOCK_SIZE (64*1024)
+
+struct ArenaBlock {
+	ArenaBlock* next;
+	size_t size; // usable bytes after the header
+	size_t used;
+};
+
+struct Arena {
+	ArenaBlock* blocks; // newest first, allocations come from the head
+	size_t allocated; // bytes handed out since the last reset
+	Arena () : blocks(NULL), allocated(0) {}
+};
+
+std::mutex arena_pool_lock;
+ArenaBlock* arena_pool; // free ARENA_BLOCK_SIZE blocks
+
+/* Offset of the next free byte in a block aligned to align */
+inline size_t arenaOffset (ArenaBlock* block, size_t align)
+{
+	size_t base = (size_t)(block + 1);
+	return ((base + block->used + align - 1) & ~(align - 1)) - base;
+}
+
+void* arenaAlloc (Arena& arena, size_t size, size_t align=16)
+{
+	ArenaBlock* block = arena.blocks;
+	if (!block || arenaOffset(block, align) + size > block->size) {
+		block = NULL;
+		if (size + align <= ARENA_BLOCK_SIZE) {
+			std::lock_guard<std::mutex> lock(arena_pool_lock);
+			if (arena_pool) {
+				block = arena_pool;
+				arena_pool = block->next;
+			}
+		}
+		if (!block) {
+			size_t bytes = max(size + align, (size_t)ARENA_BLOCK_SIZE);
+			block = (ArenaBlock*) malloc(sizeof(ArenaBlock) + bytes);
+			block->size = bytes;
+		}
+		block->used = 0;
+		block->next = arena.blocks;
+		arena.blocks = block;
+	}
+
+	size_t offset = arenaOffset(block, align);
+	block->used = offset + size;
+	arena.allocated += size;
+	return (char*)(block + 1) + offset;
+}
+
+void arenaReset (Arena& arena)
+{
+	std::lock_guard<std::mutex> lock(arena_pool_lock);
+	while (arena.blocks) {
+		ArenaBlock* block = arena.blocks;
+		arena.blocks = block->next;
+		if (block->size == ARENA_BLOCK_SIZE) {
+			block->next = arena_pool;
+			arena_pool = block;
+		}
+		else
+			free(block); // Oversized, made for one allocation
+	}
+	arena.allocated = 0;
+}
+
+/* Fixed size array in an arena, indexed like the vectors it replaces */
+template <class T>
+struct ArenaArray {
+	T* data;
+	int count;
+
+	ArenaArray () : data(NULL), count(0) {}
+	int size () const { return count; }
+	T& operator[] (int i) { return data[i]; }
+	const T& operator[] (int i) const { return data[i]; }
+	T* begin () { return data; }
+	T* end () { return data + count; }
+	const T* begin () const { return data; }
+	const T* end () const { return data + count; }
+};
+
+template <class T>
+ArenaArray<T> arenaArray (Arena& arena, int count)
+{
+	ArenaArray<T> array;
+	array.data = (T*) arenaAlloc(arena, count*sizeof(T), max((size_t)16, (size_t)alignof(T)));
+	array.count = count;
+	for (int i=0; i<count; i++)
+		new (&array.data[i]) T();
+	return array;
+}
+
+/* Per frame scratch for transient data - draw packets, matrices and text.
+   The render thread rewinds it at the start of every frame; anything past
+   FRAME_SCRATCH_SIZE spills into an arena so a busy frame still works and
+   shows up in the overflow count */
+
+#define FRAME_SCRATCH_SIZE (1024*1024)
+
+struct FrameScratch {
+	char* data;
+	size_t used, peak;
+	long overflows;
+	Arena overflow;
+} frame_scratch;
+
+void frameReset ()
+{
+	if (!frame_scratch.data)
+		frame_scratch.data = (char*) malloc(FRAME_SCRATCH_SIZE);
+	frame_scratch.peak = max(frame_scratch.peak, frame_scratch.used + frame_scratch.overflow.allocated);
+	frame_scratch.used = 0;
+	if (frame_scratch.overflow.blocks)
+		arenaReset(frame_scratch.overflow);
+}
+
+void* frameAlloc (size_t size, size_t align=16)
+{
+	size_t offset = (frame_scratch.used + align - 1) & ~(align - 1); // data is malloc aligned
+	if (offset + size > FRAME_SCRATCH_SIZE) {
+		frame_scratch.overflows++;
+		return arenaAlloc(frame_scratch.overflow, size, align);
+	}
+	frame_scratch.used = offset + size;
+	return frame_scratch.data + offset;
+}
+
+template <class T>
+ArenaArray<T> frameArray (int count)
+{
+	ArenaArray<T> array;
+	array.data = (T*) frameAlloc(count*sizeof(T), max((size_t)16, (size_t)alignof(T)));
+	array.count = count;
+	for (int i=0; i<count; i++)
+		new (&array.data[i]) T();
+	return array;
+}
+
+/* printf into the frame scratch, good until the next frameReset() */
+const char* frameFormat (const char* format, ...)
+{
+	va_list args, size_args;
+	va_start(args, format);
+	va_copy(size_args, args);
+	int length = vsnprintf(NULL, 0, format, size_args);
+	va_end(size_args);
+	char* text = (char*) frameAlloc(length + 1, 1);
+	vsnprintf(text, length + 1, format, args);
+	va_end(args);
+	return text;
+}
+
+
 struct VAO {
-	GLuint VertexArrayID;
+	GLuint VertexArrayID; // of the buffer page holding the mesh
 	GLuint VertexBuffer;
-	GLuint ColorBuffer;
-	GLuint TextureBuffer;
-	GLuint TextureID;
+	int Texture; // index into textures, see textureName()
+	int Page;
+	int FirstVertex;
+	int Order; // buddy block size, see buddyOrder()
+	int Shader; // feature key of the shader variant drawing it
+
+	GLenum PrimitiveMode; // GL_POINTS, GL_LINE_STRIP, GL_LINE_LOOP, GL_LINES, GL_LINE_STRIP_ADJACENCY, GL_LINES_ADJACENCY, GL_TRIANGLE_STRIP, GL_TRIANGLE_FAN, GL_TRIANGLES, GL_TRIANGLE_STRIP_ADJACENCY and GL_TRIANGLES_ADJACENCY
+	GLenum FillMode; // GL_FILL, GL_LINE
+	int NumVertices;
+};
+typedef struct VAO VAO;
+
+/* Meshes live in one contiguous pool and are named by handles. A handle
+   holds the pool slot and the generation it was made in; freeing a slot
+   bumps its generation, so old handles stop resolving instead of dangling.
+   The pool is only touched on the thread that holds the GL context, the
+   culling jobs just copy handles around */
+struct MeshHandle {
+	unsigned short slot;
+	unsigned short generation; // never 0 for a live mesh, so MeshHandle() is null
+};
+
+struct MeshPool {
+	vector<VAO> meshes;
+	vector<unsigned short> generations;
+	vector<unsigned short> free_slots;
+} mesh_pool;
+
+MeshHandle meshAlloc ()
+{
+	unsigned short slot;
+	if (!mesh_pool.free_slots.empty()) {
+		slot = mesh_pool.free_slots.back();
+		mesh_pool.free_slots.pop_back();
+	}
+	else {
+		slot = mesh_pool.meshes.size();
+		mesh_pool.meshes.push_back(VAO());
+		mesh_pool.generations.push_back(1);
+	}
+	MeshHandle handle = { slot, mesh_pool.generations[slot] };
+	return handle;
+}
+
+inline bool meshValid (MeshHandle handle)
+{
+	return handle.generation != 0 && handle.slot < mesh_pool.generations.size() && mesh_pool.generations[handle.slot] == handle.generation;
+}
+
+/* Only good until the next meshAlloc(), the pool may move */
+inline VAO* meshGet (MeshHandle handle)
+{
+	return meshValid(handle) ? &mesh_pool.meshes[handle.slot] : NULL;
+}
+
+void meshFree (MeshHandle handle)
+{
+	if (!meshValid(handle))
+		return;
+	unsigned short& generation = mesh_pool.generations[handle.slot];
+	if (++generation == 0)
+		generation = 1;
+	mesh_pool.free_slots.push_back(handle.slot);
+}
+
+// Level data lives in the level arenas, see platform() and createLevelMeshes()
+ArenaArray<MeshHandle>arr_block1;
+ArenaArray<glm::vec3>block1;
+
+ArenaArray<glm::vec3>block2;
+ArenaArray<glm::vec3>block4;
+ArenaArray<glm::vec3>block5;
+
+
+ArenaArray<MeshHandle>arr_block3;
+ArenaArray<MeshHandle>arr_sand;
+ArenaArray<glm::vec3>block3;
+
+struct GLMatrices {
+	glm::mat4 projection;
+	glm::mat4 model;
+	glm::mat4 view;
+	glm::mat4 screen; // framebuffer pixels from the top left corner, for text
+} Matrices;
+
+/************
+ * Profiler *
+ ************/
+
+/* Zone profiler. PROFILE_ZONE("name") times the rest of the enclosing scope.
+   Every thread appends to its own fixed ring, so recording never locks or
+   allocates; nothing is recorded unless --trace was given. A thread gets
+   its ring from profileThreadBegin() when it starts, zones on threads that
+   never called it are not recorded. Once a ring is full the
+   oldest zones are overwritten, so the trace keeps the last
+   PROFILE_BUFFER_SIZE zones of each thread. The rings are written out in
+   Chrome's trace format (chrome://tracing, ui.perfetto.dev) on exit */
+
+#define PROFILE_BUFFER_SIZE (1 << 16)
+
+struct ProfileEvent {
+	const char* name; // must be a string literal
+	long long start, end;
+};
+
+struct ProfileThread {
+	ProfileEvent events[PROFILE_BUFFER_SIZE];
+	unsigned long count; // zones ever recorded, the newest are in the ring
+	int id;
+	char name[32];
+	ProfileThread* next;
+};
+
+bool profiling = false;
+const char* trace_path = NULL;
+long long profile_epoch;
+std::atomic<ProfileThread*> profile_threads(NULL);
+std::atomic<int> profile_thread_count(0);
+thread_local ProfileThread* profile_thread = NULL;
+
+long long nowNanos ()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* First thing on every thread that records zones, after profiling is
+   set. The ring is allocated here rather than by the first zone, which
+   could sit in a frame the allocation audit checks */
+void profileThreadBegin (const char* name)
+{
+	if (!profiling || profile_thread)
+		return;
+	ProfileThread* thread = new ProfileThread;
+	thread->count = 0;
+	thread->id = profile_thread_count++;
+	snprintf(thread->name, sizeof(thread->name), "%s", name);
+	// Lock free push onto the list of all threads
+	thread->next = profile_threads;
+	while (!profile_threads.compare_exchange_weak(thread->next, thread))
+		;
+	profile_thread = thread;
+}
+
+struct ProfileZone {
+	const char* name;
+	long long start;
+
+	ProfileZone (const char* zone_name) : name(zone_name), start(profiling ? nowNanos() : 0) {}
+
+	~ProfileZone ()
+	{
+		ProfileThread* thread = profile_thread;
+		if (!thread)
+			return;
+		ProfileEvent& event = thread->events[thread->count++ % PROFILE_BUFFER_SIZE];
+		event.name = name;
+		event.start = start;
+		event.end = nowNanos();
+	}
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profile_zone_, __LINE__)(name)
+
+/* Call once every recording thread has stopped */
+void profileWriteTrace (const char* path)
+{
+	ofstream out(path);
+	if (!out.is_open()) {
+		logPrint(LOG_ERROR, "Could not write trace `%s'", path);
+		return;
+	}
+
+	unsigned long events = 0, overwritten = 0;
+	out << fixed << setprecision(3);
+	out << "{\"traceEvents\":[\n";
+	out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"sample2D\"}}";
+	for (ProfileThread* thread = profile_threads; thread; thread = thread->next) {
+		out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread->id
+			<< ",\"args\":{\"name\":\"" << thread->name << "\"}}";
+		unsigned long first = thread->count > PROFILE_BUFFER_SIZE ? thread->count - PROFILE_BUFFER_SIZE : 0;
+		for (unsigned long i=first; i<thread->count; i++) {
+			const ProfileEvent& event = thread->events[i % PROFILE_BUFFER_SIZE];
+			out << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread->id
+				<< ",\"ts\":" << (event.start - profile_epoch) / 1000.0
+				<< ",\"dur\":" << (event.end - event.start) / 1000.0 << "}";
+		}
+		events += thread->count - first;
+		overwritten += first;
+		if (first)
+			logPrint(LOG_WARN, "Trace of %s starts %.3f s in, its %lu oldest zones were overwritten",
+				thread->name, (thread->events[first % PROFILE_BUFFER_SIZE].start - profile_epoch) / 1e9, first);
+	}
+	out << "\n]}\n";
+	logPrint(LOG_INFO, "Wrote %lu zones to %s, %lu older ones overwritten", events, path, overwritten);
+}
+
+/*************
+ * Resources *
+ *************/
+
+/* Every VAO, VBO, texture and program is registered here with the scope that
+   owns it. Level meshes are made in SCOPE_LEVEL and freed together when the
+   next level is loaded; everything else lives until the render thread exits.
+   Only the thread holding the GL context touches the registry */
+
+enum ResourceType { RES_VERTEX_ARRAY, RES_BUFFER, RES_TEXTURE, RES_PROGRAM, RES_MESH, RES_TYPE_COUNT };
+enum ResourceScope { SCOPE_GLOBAL, SCOPE_LEVEL, SCOPE_COUNT };
+const char* resource_type_names[RES_TYPE_COUNT] = { "vertex arrays", "buffers", "textures", "programs", "meshes" };
+const char* resource_scope_names[SCOPE_COUNT] = { "global", "level" };
+
+struct Resource {
+	int type;
+	int scope;
+	GLuint name;
+	long long bytes;
+	MeshHandle mesh; // RES_MESH only, a block in a buffer page
+};
+
+struct ResourceRegistry {
+	vector<Resource> resources;
+	int scope; // scope new resources are put in
+	int live[SCOPE_COUNT][RES_TYPE_COUNT];
+	long long bytes[SCOPE_COUNT][RES_TYPE_COUNT];
+	long long peak_bytes;
+} registry;
+
+void resourceAdd (int type, GLuint name, long long bytes=0, MeshHandle mesh=MeshHandle())
+{
+	Resource resource = { type, registry.scope, name, bytes, mesh };
+	registry.resources.push_back(resource);
+	registry.live[registry.scope][type]++;
+	registry.bytes[registry.scope][type] += bytes;
+
+	long long total = 0;
+	for (int s=0; s<SCOPE_COUNT; s++)
+		for (int t=0; t<RES_TYPE_COUNT; t++)
+			total += registry.bytes[s][t];
+	registry.peak_bytes = max(registry.peak_bytes, total);
+}
+
+void resourceScope (int scope)
+{
+	registry.scope = scope;
+}
+
+void meshRelease (MeshHandle handle);
+
+void resourceDestroy (Resource& resource)
+{
+	switch (resource.type) {
+		case RES_VERTEX_ARRAY:
+			glDeleteVertexArrays(1, &resource.name);
+			break;
+		case RES_BUFFER:
+			glDeleteBuffers(1, &resource.name);
+			break;
+		case RES_TEXTURE:
+			glDeleteTextures(1, &resource.name);
+			break;
+		case RES_PROGRAM:
+			glDeleteProgram(resource.name);
+			break;
+		case RES_MESH:
+			meshRelease(resource.mesh);
+			break;
+	}
+}
+
+/* Delete one resource ahead of its scope, e.g. a program being replaced */
+void resourceDelete (int type, GLuint name)
+{
+	for (int i=0; i<registry.resources.size(); i++) {
+		Resource& resource = registry.resources[i];
+		if (resource.type != type || resource.name != name)
+			continue;
+		resourceDestroy(resource);
+		registry.live[resource.scope][type]--;
+		registry.bytes[resource.scope][type] -= resource.bytes;
+		registry.resources[i] = registry.resources.back();
+		registry.resources.pop_back();
+		return;
+	}
+}
+
+/* Delete every resource owned by a scope */
+void resourceRelease (int scope)
+{
+	int kept = 0;
+	for (int i=0; i<registry.resources.size(); i++) {
+		Resource& resource = registry.resources[i];
+		if (resource.scope != scope) {
+			registry.resources[kept++] = resource;
+			continue;
+		}
+		resourceDestroy(resource);
+	}
+	registry.resources.resize(kept);
+	for (int t=0; t<RES_TYPE_COUNT; t++) {
+		registry.live[scope][t] = 0;
+		registry.bytes[scope][t] = 0;
+	}
+}
+
+void resourceReport (const char* when)
+{
+	long long total = 0;
+	logPrint(LOG_INFO, "GPU resources %s:", when);
+	for (int s=0; s<SCOPE_COUNT; s++) {
+		char line[LOG_TEXT_SIZE];
+		int length = snprintf(line, sizeof(line), "  %-6s", resource_scope_names[s]);
+		for (int t=0; t<RES_TYPE_COUNT; t++) {
+			length += snprintf(line + length, sizeof(line) - length, "  %d %s", registry.live[s][t], resource_type_names[t]);
+			total += registry.bytes[s][t];
+		}
+		logPrint(LOG_INFO, "%s", line);
+	}
+	logPrint(LOG_INFO, "  %lld KB live, %lld KB peak", total/1024, registry.peak_bytes/1024);
+}
+
+
+/**************
+ * Asset Pack *
+ **************/
+
+/* assets.pak holds the level files, shader sources, images and the font in
+   one file: a header, a table of contents, then every blob at a
+   PACK_ALIGNMENT boundary, LZ4 compressed when that saves space. It is
+   mapped once at startup and readFile(), the texture decoders, platform()
+   and the font loader look there first, falling back to the loose file.
+   --pack rebuilds it from the loose files */
+
+#define PACK_FILE "assets.pak"
+#define PACK_ALIGNMENT 64
+#define PACK_MAX_FILE_SIZE (256*1024*1024) // bigger files in a pack mean it is damaged
+
+const char pack_magic[8] = { 'G', 'A', 'M', 'E', 'P', 'A', 'K', '1' };
+
+struct PackHeader {
+	char magic[8];
+	unsigned int entry_count;
+	unsigned int alignment;
+};
+
+struct PackEntry {
+	char name[48];
+	unsigned long long offset; // from the start of the file
+	unsigned int size; // as stored
+	unsigned int raw_size;
+	unsigned int compressed; // LZ4 block
+	unsigned int reserved;
+};
+
+struct AssetPack {
+	const unsigned char* data; // the whole file, mapped
+	size_t size;
+	const PackEntry* entries;
+	int entry_count;
+} asset_pack;
+
+/* Minimal LZ4 block format: sequences of a token (literal length, match
+   length - 4), literals, a 2 byte offset back into the output and the rest
+   of the match length. The last 5 bytes are always literals and no match
+   starts in the last 12, as the format requires */
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_LIMIT 12
+
+int lz4Bound (int size)
+{
+	return size + size/255 + 16;
+}
+
+unsigned char* lz4Length (unsigned char* out, int length)
+{
+	for (; length >= 255; length -= 255)
+		*out++ = 255;
+	*out++ = length;
+	return out;
+}
+
+/* Compress into dst, which must hold lz4Bound(size) bytes. Returns the compressed size */
+int lz4Compress (const unsigned char* src, int size, unsigned char* dst)
+{
+	int table[1 << LZ4_HASH_BITS];
+	for (int i=0; i<(1 << LZ4_HASH_BITS); i++)
+		table[i] = -1;
+
+	unsigned char* out = dst;
+	int anchor = 0, i = 0;
+	while (i < size - LZ4_MATCH_LIMIT) {
+		unsigned int sequence;
+		memcpy(&sequence, src + i, 4);
+		unsigned int hash = (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+		int match = table[hash];
+		table[hash] = i;
+		if (match < 0 || i - match > 65535 || memcmp(src + match, src + i, 4)) {
+			i++;
+			continue;
+		}
+
+		int length = LZ4_MIN_MATCH;
+		while (i + length < size - LZ4_LAST_LITERALS && src[match + length] == src[i + length])
+			length++;
+
+		int literals = i - anchor;
+		unsigned char* token = out++;
+		*token = (min(literals, 15) << 4) | min(length - LZ4_MIN_MATCH, 15);
+		if (literals >= 15)
+			out = lz4Length(out, literals - 15);
+		memcpy(out, src + anchor, literals);
+		out += literals;
+		*out++ = (i - match) & 0xFF;
+		*out++ = (i - match) >> 8;
+		if (length - LZ4_MIN_MATCH >= 15)
+			out = lz4Length(out, length - LZ4_MIN_MATCH - 15);
+
+		i += length;
+		anchor = i;
+	}
+
+	// Last sequence, literals only
+	int literals = size - anchor;
+	*out++ = min(literals, 15) << 4;
+	if (literals >= 15)
+		out = lz4Length(out, literals - 15);
+	memcpy(out, src + anchor, literals);
+	out += literals;
+	return out - dst;
+}
+
+/* False if src is not a valid block that decompresses to exactly raw_size bytes */
+bool lz4Decompress (const unsigned char* src, int size, unsigned char* dst, int raw_size)
+{
+	int in = 0, out = 0;
+	while (in < size) {
+		int token = src[in++];
+		int literals = token >> 4;
+		if (literals == 15) {
+			int byte;
+			do {
+				if (in >= size)
+					return false;
+				byte = src[in++];
+				literals += byte;
+			} while (byte == 255);
+		}
+		if (literals > size - in || literals > raw_size - out)
+			return false;
+		memcpy(dst + out, src + in, literals);
+		in += literals;
+		out += literals;
+		if (in == size)
+			break; // the last sequence has no match
+
+		if (size - in < 2)
+			return false;
+		int offset = src[in] | (src[in + 1] << 8);
+		in += 2;
+		if (offset == 0 || offset > out)
+			return false;
+		int length = token & 15;
+		if (length == 15) {
+			int byte;
+			do {
+				if (in >= size)
+					return false;
+				byte = src[in++];
+				length += byte;
+			} while (byte == 255);
+		}
+		length += LZ4_MIN_MATCH;
+		if (length > raw_size - out)
+			return false;
+		// Byte by byte, the match may overlap what it is copying
+		for (int i=0; i<length; i++, out++)
+			dst[out] = dst[out - offset];
+	}
+	return out == raw_size;
+}
+
+/* Map the pack, false when there is none or it is damaged */
+bool packOpen (const char* path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat info;
+	size_t size = fstat(fd, &info) == 0 ? info.st_size : 0;
+	void* mapped = size >= sizeof(PackHeader) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (mapped == MAP_FAILED)
+		return false;
+
+	const PackHeader* header = (const PackHeader*) mapped;
+	const PackEntry* entries = (const PackEntry*) (header + 1);
+	bool valid = !memcmp(header->magic, pack_magic, sizeof(pack_magic))
+		&& header->entry_count <= (size - sizeof(PackHeader)) / sizeof(PackEntry);
+	for (int i=0; valid && i<header->entry_count; i++) {
+		const PackEntry& entry = entries[i];
+		valid = entry.offset <= size && entry.size <= size - entry.offset
+			&& memchr(entry.name, 0, sizeof(entry.name));
+		// packRead() sizes its buffer from raw_size. An LZ4 block expands
+		// at most about 255 times
+		if (entry.compressed)
+			valid = valid && entry.raw_size <= PACK_MAX_FILE_SIZE && entry.raw_size <= (unsigned long long)entry.size*255 + 16;
+		else
+			valid = valid && entry.raw_size == entry.size;
+	}
+	if (!valid) {
+		logPrint(LOG_WARN, "Ignoring %s, it is damaged", path);
+		munmap(mapped, size);
+		return false;
+	}
+
+	asset_pack.data = (const unsigned char*) mapped;
+	asset_pack.size = size;
+	asset_pack.entries = entries;
+	asset_pack.entry_count = header->entry_count;
+	logPrint(LOG_INFO, "Opened %s, %d files", path, (int)asset_pack.entry_count);
+	return true;
+}
+
+const PackEntry* packFind (const char* name)
+{
+	for (int i=0; i<asset_pack.entry_count; i++)
+		if (!strcmp(asset_pack.entries[i].name, name))
+			return &asset_pack.entries[i];
+	return NULL;
+}
+
+/* A stored (uncompressed) file straight from the mapping, NULL otherwise */
+const unsigned char* packView (const char* name, size_t& size)
+{
+	const PackEntry* entry = packFind(name);
+	if (!entry || entry->compressed)
+		return NULL;
+	size = entry->size;
+	return asset_pack.data + entry->offset;
+}
+
+/* Whole file from the pack into contents */
+bool packRead (const char* name, string& contents)
+{
+	const PackEntry* entry = packFind(name);
+	if (!entry)
+		return false;
+	const unsigned char* data = asset_pack.data + entry->offset;
+	contents.assign(entry->raw_size, '\0');
+	if (!entry->compressed) {
+		memcpy(&contents[0], data, entry->size);
+		return true;
+	}
+	if (!lz4Decompress(data, entry->size, (unsigned char*) &contents[0], entry->raw_size)) {
+		logPrint(LOG_ERROR, "Could not decompress %s from the pack", name);
+		return false;
+	}
+	return true;
+}
+
+/* Whole file in one read, empty if it can't be opened */
+string readLooseFile (const char* path)
+{
+	ifstream file(path, ios::in | ios::binary);
+	if (!file.is_open())
+		return string();
+	file.seekg(0, ios::end);
+	string contents(file.tellg(), '\0');
+	file.seekg(0, ios::beg);
+	file.read(&contents[0], contents.size());
+	return contents;
+}
+
+/* From the pack if it has the file, else the loose file */
+string readFile (const char* path)
+{
+	string contents;
+	if (packRead(path, contents))
+		return contents;
+	return readLooseFile(path);
+}
+
+/* Decode an image to RGB, from the pack when it is there */
+unsigned char* loadImage (const char* filename, int* width, int* height)
+{
+	size_t size;
+	const unsigned char* stored = packView(filename, size);
+	if (stored)
+		return SOIL_load_image_from_memory(stored, size, width, height, 0, SOIL_LOAD_RGB);
+	string contents;
+	if (packRead(filename, contents))
+		return SOIL_load_image_from_memory((const unsigned char*) contents.data(), contents.size(), width, height, 0, SOIL_LOAD_RGB);
+	return SOIL_load_image(filename, width, height, 0, SOIL_LOAD_RGB);
+}
+
+/* Everything the game loads; files missing from the directory are skipped */
+const char* pack_files[] = {
+	"0.txt", "1.txt", "2.txt", "3.txt",
+	"Scene.vert", "Scene.frag",
+	"beach.png", "beach2.png", "beach.ktx", "beach2.ktx",
+	"arial.ttf",
+};
+
+bool packWrite (const char* path)
+{
+	int count = sizeof(pack_files)/sizeof(pack_files[0]);
+	vector<PackEntry> entries;
+	vector<string> blobs;
+	for (int i=0; i<count; i++) {
+		string raw = readLooseFile(pack_files[i]);
+		if (raw.empty())
+			continue;
+
+		PackEntry entry;
+		memset(&entry, 0, sizeof(entry));
+		strncpy(entry.name, pack_files[i], sizeof(entry.name) - 1);
+		entry.raw_size = raw.size();
+
+		// KTX files stay stored so their levels upload straight from the mapping
+		string blob = raw;
+		if (!strstr(pack_files[i], ".ktx")) {
+			string compressed(lz4Bound(raw.size()), '\0');
+			compressed.resize(lz4Compress((const unsigned char*) raw.data(), raw.size(), (unsigned char*) &compressed[0]));
+			if (compressed.size() < raw.size() - raw.size()/8) {
+				blob.swap(compressed);
+				entry.compressed = 1;
+			}
+		}
+		entry.size = blob.size();
+		entries.push_back(entry);
+		blobs.push_back(blob);
+	}
+
+	PackHeader header;
+	memcpy(header.magic, pack_magic, sizeof(pack_magic));
+	header.entry_count = entries.size();
+	header.alignment = PACK_ALIGNMENT;
+	unsigned long long offset = sizeof(PackHeader) + entries.size()*sizeof(PackEntry);
+	for (int i=0; i<entries.size(); i++) {
+		offset = (offset + PACK_ALIGNMENT - 1) / PACK_ALIGNMENT * PACK_ALIGNMENT;
+		entries[i].offset = offset;
+		offset += entries[i].size;
+	}
+
+	ofstream out(path, ios::out | ios::binary);
+	out.write((const char*) &header, sizeof(header));
+	if (!entries.empty())
+		out.write((const char*) &entries[0], entries.size()*sizeof(PackEntry));
+	for (int i=0; i<entries.size(); i++) {
+		string padding(entries[i].offset - out.tellp(), '\0');
+		out.write(padding.data(), padding.size());
+		out.write(blobs[i].data(), blobs[i].size());
+		cout << "  " << setw(12) << left << entries[i].name << right << setw(8) << entries[i].raw_size << " -> "
+			<< setw(8) << entries[i].size << (entries[i].compressed ? " lz4" : " stored") << endl;
+	}
+	if (!out) {
+		cout << "Could not write " << path << endl;
+		return false;
+	}
+	cout << "Wrote " << path << ", " << entries.size() << " files, " << offset/1024 << " KB" << endl;
+	return true;
+}
+
+
+/****************
+ * Shader Cache *
+ ****************/
+
+/* Linked programs are saved with glGetProgramBinary under shader_cache/, named
+   by a hash of both sources and the driver's vendor, renderer and version
+   strings. A later start loads the binary with glProgramBinary and only
+   compiles from source when there is no entry or the driver rejects it.
+   Deleting the directory clears the cache */
+
+#define SHADER_CACHE_DIR "shader_cache"
+
+bool shader_cache = true;
+
+/* FNV-1a */
+unsigned long long hashBytes (const void* data, size_t size, unsigned long long hash=14695981039346656037ULL)
+{
+	const unsigned char* bytes = (const unsigned char*) data;
+	for (size_t i=0; i<size; i++)
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	return hash;
+}
+
+bool shaderCacheSupported ()
+{
+	if (!shader_cache || !(GLAD_GL_VERSION_4_1 || GLAD_GL_ARB_get_program_binary))
+		return false;
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return formats > 0;
+}
+
+string shaderCachePath (const string& vertex_source, const string& fragment_source)
+{
+	const GLubyte* driver[3] = { glGetString(GL_VENDOR), glGetString(GL_RENDERER), glGetString(GL_VERSION) };
+	unsigned long long hash = hashBytes(vertex_source.data(), vertex_source.size());
+	hash = hashBytes("\0", 1, hash); // so moving text between the stages changes the key
+	hash = hashBytes(fragment_source.data(), fragment_source.size(), hash);
+	for (int i=0; i<3; i++)
+		if (driver[i])
+			hash = hashBytes(driver[i], strlen((const char*)driver[i]), hash);
+
+	char name[64];
+	snprintf(name, sizeof(name), SHADER_CACHE_DIR "/%016llx.bin", hash);
+	return name;
+}
+
+/* Linked program from the cache, 0 when missing or rejected by the driver */
+GLuint loadCachedProgram (const string& path)
+{
+	string binary = readLooseFile(path.c_str());
+	if (binary.size() <= sizeof(GLenum))
+		return 0;
+
+	GLenum format;
+	memcpy(&format, binary.data(), sizeof(GLenum));
+	GLuint ProgramID = glCreateProgram();
+	glProgramBinary(ProgramID, format, binary.data() + sizeof(GLenum), binary.size() - sizeof(GLenum));
+
+	GLint Result = GL_FALSE;
+	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+	if (Result != GL_TRUE) {
+		// Driver update or a different GPU, rebuild from source
+		glDeleteProgram(ProgramID);
+		return 0;
+	}
+	return ProgramID;
+}
+
+void saveCachedProgram (const string& path, GLuint ProgramID)
+{
+	GLint length = 0;
+	glGetProgramiv(ProgramID, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	std::vector<char> binary(sizeof(GLenum) + length);
+	GLenum format;
+	glGetProgramBinary(ProgramID, length, NULL, &format, &binary[sizeof(GLenum)]);
+	memcpy(&binary[0], &format, sizeof(GLenum));
+
+	mkdir(SHADER_CACHE_DIR, 0755);
+	ofstream file(path.c_str(), ios::out | ios::binary);
+	file.write(&binary[0], binary.size());
+	if (!file)
+		logPrint(LOG_WARN, "Could not write shader cache %s", path.c_str());
+}
+
+/*****************
+ * Shader Builds *
+ *****************/
+
+/* submitShaders() starts compiling and linking a program and returns right
+   away; nothing asks the driver for a status until pollShaderBuilds() finds
+   the program complete. With KHR/ARB_parallel_shader_compile the driver
+   compiles on its own threads and GL_COMPLETION_STATUS_KHR tells when a
+   program is done, so initGL() can load textures and the font meanwhile.
+   Without it the first status query blocks, as LoadShaders() always did */
+
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1 // same value as GL_COMPLETION_STATUS_ARB
+#endif
+
+typedef void (APIENTRY *MaxShaderCompilerThreadsProc) (GLuint count);
+
+bool parallel_shader_compile = false;
+
+struct ShaderBuild {
+	const char* vertex_file_path;
+	const char* fragment_file_path;
+	GLuint* program; // set once the build finishes
+	GLuint VertexShaderID, FragmentShaderID, ProgramID;
+	std::string cache_path; // empty if the program can't be cached
+	bool reload; // replaces *program, which is kept if the build fails
+};
+
+std::vector<ShaderBuild> shader_builds;
+
+void programLocations ();
+
+/* Hand out a linked program; a reload deletes the one it replaces */
+void installProgram (const ShaderBuild& build, GLuint ProgramID)
+{
+	if (build.reload) {
+		resourceDelete(RES_PROGRAM, *build.program);
+		logPrint(LOG_INFO, "Reloaded %s, %s", build.vertex_file_path, build.fragment_file_path);
+	}
+	*build.program = ProgramID;
+	if (build.reload)
+		programLocations();
+}
+
+void shaderBuildInit ()
+{
+	MaxShaderCompilerThreadsProc threads = NULL;
+	if (glfwExtensionSupported("GL_KHR_parallel_shader_compile"))
+		threads = (MaxShaderCompilerThreadsProc) glfwGetProcAddress("glMaxShaderCompilerThreadsKHR");
+	else if (GLAD_GL_ARB_parallel_shader_compile)
+		threads = (MaxShaderCompilerThreadsProc) glMaxShaderCompilerThreadsARB;
+	if (threads) {
+		threads(0xFFFFFFFF); // as many as the driver likes
+		parallel_shader_compile = true;
+	}
+	logPrint(LOG_INFO, "Parallel shader compile: %s", parallel_shader_compile ? "yes" : "no");
+}
+
+void submitShaderSources (const char* vertex_file_path, const char* fragment_file_path,
+	const std::string& VertexShaderCode, const std::string& FragmentShaderCode, GLuint* program, bool reload=false)
+{
+	PROFILE_ZONE("submitShaders");
+
+	ShaderBuild build;
+	build.vertex_file_path = vertex_file_path;
+	build.fragment_file_path = fragment_file_path;
+	build.program = program;
+	build.reload = reload;
+
+	// Reuse the program linked by an earlier run when the driver accepts it
+	if (shaderCacheSupported()) {
+		build.cache_path = shaderCachePath(VertexShaderCode, FragmentShaderCode);
+		GLuint ProgramID = loadCachedProgram(build.cache_path);
+		if (ProgramID) {
+			logPrint(LOG_INFO, "Loaded program %s, %s from %s", vertex_file_path, fragment_file_path, build.cache_path.c_str());
+			resourceAdd(RES_PROGRAM, ProgramID);
+			installProgram(build, ProgramID);
+			return;
+		}
+	}
+
+	// Create the shaders
+	build.VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
+	build.FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+
+	// Compile Vertex Shader
+	char const * VertexSourcePointer = VertexShaderCode.c_str();
+	glShaderSource(build.VertexShaderID, 1, &VertexSourcePointer , NULL);
+	glCompileShader(build.VertexShaderID);
+
+	// Compile Fragment Shader
+	char const * FragmentSourcePointer = FragmentShaderCode.c_str();
+	glShaderSource(build.FragmentShaderID, 1, &FragmentSourcePointer , NULL);
+	glCompileShader(build.FragmentShaderID);
+
+	// Link the program, the driver waits for the stages itself
+	build.ProgramID = glCreateProgram();
+	resourceAdd(RES_PROGRAM, build.ProgramID);
+	glAttachShader(build.ProgramID, build.VertexShaderID);
+	glAttachShader(build.ProgramID, build.FragmentShaderID);
+	if (!build.cache_path.empty())
+		glProgramParameteri(build.ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(build.ProgramID);
+
+	shader_builds.push_back(build);
+}
+
+void submitShaders (const char* vertex_file_path, const char* fragment_file_path, GLuint* program)
+{
+	// Read the shader code from the files
+	submitShaderSources(vertex_file_path, fragment_file_path, readFile(vertex_file_path), readFile(fragment_file_path), program);
+}
+
+/* Print the logs of a complete build and hand the program out */
+void finishShaderBuild (ShaderBuild& build)
+{
+	PROFILE_ZONE("finishShaderBuild");
+	GLint Result = GL_FALSE;
+	int InfoLogLength;
+
+	// Check Vertex Shader
+	logPrint(LOG_INFO, "Compiling shader : %s", build.vertex_file_path);
+	glGetShaderiv(build.VertexShaderID, GL_COMPILE_STATUS, &Result);
+	glGetShaderiv(build.VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	std::vector<char> VertexShaderErrorMessage( max(InfoLogLength, int(1)) );
+	glGetShaderInfoLog(build.VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
+	logLines(Result == GL_TRUE ? LOG_INFO : LOG_ERROR, VertexShaderErrorMessage.data());
+
+	// Check Fragment Shader
+	logPrint(LOG_INFO, "Compiling shader : %s", build.fragment_file_path);
+	glGetShaderiv(build.FragmentShaderID, GL_COMPILE_STATUS, &Result);
+	glGetShaderiv(build.FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	std::vector<char> FragmentShaderErrorMessage( max(InfoLogLength, int(1)) );
+	glGetShaderInfoLog(build.FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
+	logLines(Result == GL_TRUE ? LOG_INFO : LOG_ERROR, FragmentShaderErrorMessage.data());
+
+	// Check the program
+	logPrint(LOG_INFO, "Linking program");
+	glGetProgramiv(build.ProgramID, GL_LINK_STATUS, &Result);
+	glGetProgramiv(build.ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
+	glGetProgramInfoLog(build.ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
+	logLines(Result == GL_TRUE ? LOG_INFO : LOG_ERROR, ProgramErrorMessage.data());
+
+	glDeleteShader(build.VertexShaderID);
+	glDeleteShader(build.FragmentShaderID);
+
+	if (build.reload && Result != GL_TRUE) {
+		logPrint(LOG_WARN, "Keeping the previous program");
+		resourceDelete(RES_PROGRAM, build.ProgramID);
+		return;
+	}
+
+	if (!build.cache_path.empty() && Result == GL_TRUE)
+		saveCachedProgram(build.cache_path, build.ProgramID);
+
+	installProgram(build, build.ProgramID);
+}
+
+/* Finish every build the driver has completed, or all of them when wait is
+   set. True once nothing is pending */
+bool pollShaderBuilds (bool wait)
+{
+	int pending = 0;
+	for (int i=0; i<shader_builds.size(); i++) {
+		ShaderBuild& build = shader_builds[i];
+		GLint complete = GL_TRUE;
+		if (!wait && parallel_shader_compile)
+			glGetProgramiv(build.ProgramID, GL_COMPLETION_STATUS_KHR, &complete);
+		else if (!wait)
+			complete = GL_FALSE; // a status query would block, leave it for the wait
+		if (complete)
+			finishShaderBuild(build);
+		else
+			shader_builds[pending++] = build;
+	}
+	shader_builds.resize(pending);
+	return pending == 0;
+}
+
+/* Function to load Shaders - Use it as it is */
+GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+	GLuint ProgramID = 0;
+	submitShaders(vertex_file_path, fragment_file_path, &ProgramID);
+	pollShaderBuilds(true);
+	return ProgramID;
+}
+
+/*******************
+ * Shader Variants *
+ *******************/
+
+/* Every program is Scene.vert/Scene.frag compiled with a #define per feature
+   it needs, so a draw gets exactly the code it uses and the GLSL never
+   branches on a uniform. Variants are kept by their feature bitmask; a mesh
+   records its key and draw3DObject() picks the variant with useShader() */
+
+enum ShaderFeature {
+	FEATURE_VERTEX_COLOR = 1 << 0, // color attribute per vertex
+	FEATURE_UNIFORM_COLOR = 1 << 1, // one color uniform per draw
+	FEATURE_TEXTURED = 1 << 2, // texture coordinates and texSampler
+	FEATURE_INSTANCED = 1 << 3, // MVP per instance from the stream buffer
+	FEATURE_SDF = 1 << 4, // with TEXTURED, alpha from a distance field (text)
+	FEATURE_TEXTURE_ARRAY = 1 << 5, // with TEXTURED, layer index as third coordinate
+};
+
+#define FEATURE_COUNT 6
+const char* shader_feature_names[FEATURE_COUNT] = {
+	"VERTEX_COLOR", "UNIFORM_COLOR", "TEXTURED", "INSTANCED", "SDF", "TEXTURE_ARRAY"
+};
+
+// The variants the game draws with
+#define SCENE_SHADER (FEATURE_VERTEX_COLOR | FEATURE_INSTANCED)
+#define TEXTURE_SHADER (FEATURE_TEXTURED)
+#define TEXT_SHADER (FEATURE_VERTEX_COLOR | FEATURE_TEXTURED | FEATURE_SDF)
+#define TILE_SHADER (FEATURE_TEXTURED | FEATURE_TEXTURE_ARRAY | FEATURE_INSTANCED)
+
+#define SHADER_VERTEX_FILE "Scene.vert"
+#define SHADER_FRAGMENT_FILE "Scene.frag"
+
+struct ShaderVariant {
+	GLuint program; // 0 until its build finishes
+	bool submitted;
+	char vertex_name[96]; // file and features, for the build log
+	char fragment_name[96];
+	GLint MatrixID, ColorID; // -1 where the variant has no such uniform
+};
+
+ShaderVariant shader_variants[1 << FEATURE_COUNT];
+
+std::string shaderVariantSource (const std::string& source, int features)
+{
+	std::string code = "#version 330 core\n";
+	for (int i=0; i<FEATURE_COUNT; i++)
+		if (features & (1 << i))
+			code += std::string("#define ") + shader_feature_names[i] + "\n";
+	return code + "#line 1\n" + source; // keep log line numbers those of the file
+}
+
+void shaderVariantName (char* name, int size, const char* file_path, int features)
+{
+	int length = snprintf(name, size, "%s", file_path);
+	for (int i=0; i<FEATURE_COUNT && length < size; i++)
+		if (features & (1 << i))
+			length += snprintf(name + length, size - length, " %s", shader_feature_names[i]);
+}
+
+/* Start building a variant from the given sources. A reload replaces the
+   program in place once it links */
+void submitShaderVariant (int features, const std::string& vertex_source, const std::string& fragment_source, bool reload=false)
+{
+	ShaderVariant& variant = shader_variants[features];
+	if (!variant.submitted) {
+		shaderVariantName(variant.vertex_name, sizeof(variant.vertex_name), SHADER_VERTEX_FILE, features);
+		shaderVariantName(variant.fragment_name, sizeof(variant.fragment_name), SHADER_FRAGMENT_FILE, features);
+		variant.submitted = true;
+	}
+	submitShaderSources(variant.vertex_name, variant.fragment_name,
+		shaderVariantSource(vertex_source, features), shaderVariantSource(fragment_source, features),
+		&variant.program, reload);
+}
+
+void submitShaderVariant (int features)
+{
+	submitShaderVariant(features, readFile(SHADER_VERTEX_FILE), readFile(SHADER_FRAGMENT_FILE));
+}
+
+static void error_callback(int error, const char* description)
+{
+	logPrint(LOG_ERROR, "GLFW: %s", description);
+}
+
+/* Simulation and render threads are joined by main() once the window closes */
+void quit(GLFWwindow *window)
+{
+	glfwSetWindowShouldClose(window, 1);
+}
+
+glm::vec3 getRGBfromHue (int hue)
+{
+	float intp;
+	float fracp = modff(hue/60.0, &intp);
+	float x = 1.0 - abs((float)((int)intp%2)+fracp-1.0);
+
+	if (hue < 60)
+		return glm::vec3(1,x,0);
+	else if (hue < 120)
+		return glm::vec3(x,1,0);
+	else if (hue < 180)
+		return glm::vec3(0,1,x);
+	else if (hue < 240)
+		return glm::vec3(0,x,1);
+	else if (hue < 300)
+		return glm::vec3(x,0,1);
+	else
+		return glm::vec3(1,0,x);
+}
+
+/* Scratch for vertex data on its way into a VBO, reset after each upload */
+Arena staging_arena;
+
+/*****************
+ * Stream Buffer *
+ *****************/
+
+/* Per frame data (the MVP of every instance drawn, the text vertices) is
+   written into a ring of STREAM_FRAMES regions of one buffer. A region is
+   fenced after the frame that used it and only rewritten once the fence
+   has passed, so the GPU is never waited on while it still reads the data. With GL 4.4 or
+   ARB_buffer_storage the buffer stays persistently mapped; on plain 3.3
+   each region is mapped unsynchronized and invalidated for the frame */
+
+#define STREAM_FRAMES 3
+#define STREAM_REGION_SIZE (2*1024*1024) // a slot for every block, a full text batch
+
+struct StreamBuffer {
+	GLuint buffer;
+	bool persistent;
+	char* mapped; // whole buffer when persistent, else the current region while writing
+	int region;
+	size_t offset; // within the region
+	GLsync fences[STREAM_FRAMES];
+	long stalls; // frames that had to wait for their region
+	long overflows; // packet lists, instances or text dropped because a region was full
+	long map_failures; // frames drawn without instances, their region would not map
+} stream;
+
+void streamInit ()
+{
+	glGenBuffers(1, &stream.buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, stream.buffer);
+	stream.persistent = GLAD_GL_VERSION_4_4 || GLAD_GL_ARB_buffer_storage;
+	if (stream.persistent) {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, STREAM_FRAMES*STREAM_REGION_SIZE, NULL, flags);
+		stream.mapped = (char*) glMapBufferRange(GL_ARRAY_BUFFER, 0, STREAM_FRAMES*STREAM_REGION_SIZE, flags);
+	}
+	else
+		glBufferData(GL_ARRAY_BUFFER, STREAM_FRAMES*STREAM_REGION_SIZE, NULL, GL_STREAM_DRAW);
+	resourceAdd(RES_BUFFER, stream.buffer, STREAM_FRAMES*STREAM_REGION_SIZE);
+	logPrint(LOG_INFO, "Stream buffer: %s", stream.persistent ? "persistent mapping" : "unsynchronized mapping");
+}
+
+void streamBeginFrame ()
+{
+	GLsync& fence = stream.fences[stream.region];
+	if (fence) {
+		if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+			stream.stalls++;
+			while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+				;
+		}
+		glDeleteSync(fence);
+		fence = 0;
+	}
+
+	stream.offset = 0;
+	if (!stream.persistent) {
+		glBindBuffer(GL_ARRAY_BUFFER, stream.buffer);
+		stream.mapped = (char*) glMapBufferRange(GL_ARRAY_BUFFER, stream.region*STREAM_REGION_SIZE, STREAM_REGION_SIZE,
+			GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+		if (!stream.mapped) {
+			// Nothing fits this frame, streamAlloc() hands out no space
+			if (stream.map_failures++ == 0)
+				logPrint(LOG_WARN, "Could not map the stream buffer, frames go without instances");
+			stream.offset = STREAM_REGION_SIZE;
+		}
+	}
+}
+
+/* Space for size bytes in this frame's region, NULL when it is full.
+   offset is where the data sits in the buffer, for attribute pointers */
+void* streamAlloc (size_t size, GLintptr& offset)
+{
+	if (stream.offset + size > STREAM_REGION_SIZE) {
+		if (stream.mapped)
+			stream.overflows++;
+		return NULL;
+	}
+	size_t region_start = stream.region*STREAM_REGION_SIZE;
+	offset = region_start + stream.offset;
+	char* data = stream.mapped + (stream.persistent ? region_start : 0) + stream.offset;
+	stream.offset += size;
+	return data;
+}
+
+/* Done writing, leaves the stream buffer bound for the instance attributes */
+void streamEndWrites ()
+{
+	glBindBuffer(GL_ARRAY_BUFFER, stream.buffer);
+	if (!stream.persistent && stream.mapped)
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+}
+
+/* After the last draw reading this frame's region */
+void streamEndFrame ()
+{
+	stream.fences[stream.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	stream.region = (stream.region + 1) % STREAM_FRAMES;
+}
+
+/****************
+ * Buffer Pages *
+ ****************/
+
+/* Meshes don't get buffers of their own. Vertices are interleaved into large
+   page VBOs, one vertex format per page, and every mesh takes a block of a
+   page from a buddy allocator. The page VAO has its attributes set up once,
+   so a draw only binds the page and passes the mesh's first vertex.
+   Pages are global; freeing a mesh hands its block back to the page */
+
+#define PAGE_VERTICES 65536
+#define BUDDY_MIN_VERTICES 16
+#define BUDDY_ORDERS 13 // BUDDY_MIN_VERTICES << 12 is the whole page
+
+enum VertexFormat { FORMAT_COLOR, FORMAT_TEXTURE, FORMAT_TEXTURE_ARRAY, FORMAT_COUNT };
+const int format_floats[FORMAT_COUNT] = { 6, 5, 6 }; // x,y,z + r,g,b or s,t or s,t,layer
+const int format_shaders[FORMAT_COUNT] = { SCENE_SHADER, TEXTURE_SHADER, TILE_SHADER };
+const char* format_names[FORMAT_COUNT] = { "color", "texture", "array" };
+
+struct BufferPage {
+	int format;
+	GLuint vertex_array;
+	GLuint buffer;
+	int used; // vertices in allocated blocks
+	vector<int> free_blocks[BUDDY_ORDERS]; // first vertex of each free block
+};
+
+vector<BufferPage> buffer_pages;
+
+int buddyOrder (int vertices)
+{
+	int order = 0;
+	while ((BUDDY_MIN_VERTICES << order) < vertices)
+		order++;
+	return order;
+}
+
+/* First vertex of a free block of the given order, or -1 when the page is full */
+int buddyAlloc (BufferPage& page, int order)
+{
+	int o = order;
+	while (o < BUDDY_ORDERS && page.free_blocks[o].empty())
+		o++;
+	if (o == BUDDY_ORDERS)
+		return -1;
+
+	int first = page.free_blocks[o].back();
+	page.free_blocks[o].pop_back();
+	// Split down to the size asked for, the upper halves stay free
+	while (o > order) {
+		o--;
+		page.free_blocks[o].push_back(first + (BUDDY_MIN_VERTICES << o));
+	}
+	page.used += BUDDY_MIN_VERTICES << order;
+	return first;
+}
+
+void buddyFree (BufferPage& page, int first, int order)
+{
+	page.used -= BUDDY_MIN_VERTICES << order;
+	// Merge with the buddy for as long as it is free too
+	while (order < BUDDY_ORDERS - 1) {
+		int buddy = first ^ (BUDDY_MIN_VERTICES << order);
+		vector<int>& list = page.free_blocks[order];
+		vector<int>::iterator it = find(list.begin(), list.end(), buddy);
+		if (it == list.end())
+			break;
+		*it = list.back();
+		list.pop_back();
+		first = min(first, buddy);
+		order++;
+	}
+	page.free_blocks[order].push_back(first);
+}
+
+int createBufferPage (int format)
+{
+	BufferPage page;
+	page.format = format;
+	page.used = 0;
+	page.free_blocks[BUDDY_ORDERS - 1].push_back(0);
+
+	GLsizei stride = format_floats[format]*sizeof(GLfloat);
+	glGenVertexArrays(1, &page.vertex_array);
+	glGenBuffers(1, &page.buffer);
+	glBindVertexArray(page.vertex_array);
+	glBindBuffer(GL_ARRAY_BUFFER, page.buffer);
+	glBufferData(GL_ARRAY_BUFFER, PAGE_VERTICES*stride, NULL, GL_STATIC_DRAW);
+
+	// attribute 0. Vertices, then 1. Color or 2. Textures
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+	if (format == FORMAT_COLOR) {
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)(3*sizeof(GLfloat)));
+	}
+	else {
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, format_floats[format] - 3, GL_FLOAT, GL_FALSE, stride, (void*)(3*sizeof(GLfloat)));
+	}
+
+	// attributes 3-6. Per instance MVP of the instanced shaders, draw3DObject()
+	// points them at the batch's matrices in the stream buffer
+	if (format_shaders[format] & FEATURE_INSTANCED)
+		for (int i=0; i<4; i++) {
+			glEnableVertexAttribArray(3 + i);
+			glVertexAttribDivisor(3 + i, 1);
+		}
+
+	// Pages outlive the level that happened to need them
+	int scope = registry.scope;
+	resourceScope(SCOPE_GLOBAL);
+	resourceAdd(RES_VERTEX_ARRAY, page.vertex_array);
+	resourceAdd(RES_BUFFER, page.buffer, (long long)PAGE_VERTICES*stride);
+	resourceScope(scope);
+
+	buffer_pages.push_back(page);
+	return buffer_pages.size() - 1;
+}
+
+/* Upload a mesh into the first page of its format with room for it */
+MeshHandle createPagedMesh (int format, GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* attribute_data, GLenum fill_mode)
+{
+	// Not even an empty page holds it; the invalid handle draws nothing.
+	// Drop whatever the caller staged (create3DObject()'s colors) as well
+	if (numVertices > PAGE_VERTICES) {
+		logPrint(LOG_ERROR, "Mesh of %d vertices is larger than a buffer page (%d), not created", numVertices, PAGE_VERTICES);
+		arenaReset(staging_arena);
+		return MeshHandle();
+	}
+
+	int order = buddyOrder(numVertices);
+	int page = -1, first = -1;
+	for (int i=0; i<buffer_pages.size() && first < 0; i++)
+		if (buffer_pages[i].format == format) {
+			page = i;
+			first = buddyAlloc(buffer_pages[i], order);
+		}
+	if (first < 0) {
+		page = createBufferPage(format);
+		first = buddyAlloc(buffer_pages[page], order);
+	}
+
+	// Interleave position and color/texture coordinates
+	int floats = format_floats[format];
+	int attribute_floats = floats - 3;
+	GLfloat* data = arenaArray<GLfloat>(staging_arena, floats*numVertices).data;
+	for (int i=0; i<numVertices; i++) {
+		memcpy(data + floats*i, vertex_buffer_data + 3*i, 3*sizeof(GLfloat));
+		memcpy(data + floats*i + 3, attribute_data + attribute_floats*i, attribute_floats*sizeof(GLfloat));
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, buffer_pages[page].buffer);
+	glBufferSubData(GL_ARRAY_BUFFER, first*floats*sizeof(GLfloat), numVertices*floats*sizeof(GLfloat), data);
+	arenaReset(staging_arena);
+
+	MeshHandle handle = meshAlloc();
+	struct VAO* vao = meshGet(handle);
+	vao->VertexArrayID = buffer_pages[page].vertex_array;
+	vao->VertexBuffer = buffer_pages[page].buffer;
+	vao->Texture = -1;
+	vao->Shader = format_shaders[format];
+	vao->PrimitiveMode = primitive_mode;
+	vao->FillMode = fill_mode;
+	vao->NumVertices = numVertices;
+	vao->Page = page;
+	vao->FirstVertex = first;
+	vao->Order = order;
+	resourceAdd(RES_MESH, 0, 0, handle);
+	return handle;
+}
+
+/* Hand the mesh's block back to its page and free the handle */
+void meshRelease (MeshHandle handle)
+{
+	VAO* vao = meshGet(handle);
+	if (!vao)
+		return;
+	buddyFree(buffer_pages[vao->Page], vao->FirstVertex, vao->Order);
+	meshFree(handle);
+}
+
+void bufferPageReport ()
+{
+	for (int i=0; i<buffer_pages.size(); i++)
+		logPrint(LOG_INFO, "  page %d %-8s%d of %d vertices in use", i, format_names[buffer_pages[i].format], buffer_pages[i].used, PAGE_VERTICES);
+}
+
+/* Generate VAO, VBOs and return VAO handle */
+MeshHandle create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+{
+	return createPagedMesh(FORMAT_COLOR, primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+}
+
+/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
+MeshHandle create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+{
+	GLfloat* color_buffer_data = arenaArray<GLfloat>(staging_arena, 3*numVertices).data;
+	for (int i=0; i<numVertices; i++) {
+		color_buffer_data [3*i] = red;
+		color_buffer_data [3*i + 1] = green;
+		color_buffer_data [3*i + 2] = blue;
+	}
+
+	// Uploading resets the staging arena
+	return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+}
+
+MeshHandle create3DTexturedObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* texture_buffer_data, int texture, GLenum fill_mode=GL_FILL)
+{
+	MeshHandle handle = createPagedMesh(FORMAT_TEXTURE, primitive_mode, numVertices, vertex_buffer_data, texture_buffer_data, fill_mode);
+	if (VAO* vao = meshGet(handle))
+		vao->Texture = texture;
+	return handle;
+}
+
+/* Texture coordinates are s,t,layer into an array texture (createTextureArray()).
+   Drawn instanced like the colored meshes */
+MeshHandle create3DTextureArrayObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* texture_buffer_data, int texture, GLenum fill_mode=GL_FILL)
+{
+	MeshHandle handle = createPagedMesh(FORMAT_TEXTURE_ARRAY, primitive_mode, numVertices, vertex_buffer_data, texture_buffer_data, fill_mode);
+	if (VAO* vao = meshGet(handle))
+		vao->Texture = texture;
+	return handle;
+}
+
+/* Last program, VAO and fill mode set by the draw functions, so runs of
+   meshes from the same page skip the rebind. Reset at the start of every
+   frame since other code (texture uploads) binds its own */
+struct BoundState {
+	GLuint program;
+	GLuint vertex_array;
+	GLuint texture;
+	GLenum fill_mode;
+} bound_state;
+
+void resetBoundState ()
+{
+	bound_state.program = 0;
+	bound_state.texture = 0;
+	bound_state.vertex_array = 0;
+	bound_state.fill_mode = 0;
+}
+
+/* Make the variant with these features current. One nobody submitted up
+   front is built here, blocking, the first time it is asked for */
+ShaderVariant& useShader (int features)
+{
+	ShaderVariant& variant = shader_variants[features];
+	if (!variant.program) {
+		if (!variant.submitted)
+			submitShaderVariant(features);
+		pollShaderBuilds(true);
+		programLocations();
+	}
+	if (variant.program != bound_state.program) {
+		glUseProgram(variant.program);
+		bound_state.program = variant.program;
+	}
+	return variant;
+}
+
+GLenum textureTarget (int texture);
+GLuint textureName (int texture);
+
+/* Render instances of the mesh, their MVPs start at instance_offset in the
+   stream buffer, which must be bound (see streamEndWrites()) */
+void draw3DObject (MeshHandle handle, GLintptr instance_offset, int instances)
+{
+	struct VAO* vao = meshGet(handle);
+	if (!vao)
+		return; // Freed or never made
+
+	useShader(vao->Shader);
+
+	// Change the Fill Mode for this object
+	if (vao->FillMode != bound_state.fill_mode) {
+		glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+		bound_state.fill_mode = vao->FillMode;
+	}
+
+	// Bind the page VAO, its attributes are already enabled
+	if (vao->VertexArrayID != bound_state.vertex_array) {
+		glBindVertexArray (vao->VertexArrayID);
+		bound_state.vertex_array = vao->VertexArrayID;
+	}
+
+	// Meshes sharing an array texture keep it bound
+	if (vao->Texture >= 0 && textureName(vao->Texture) != bound_state.texture) {
+		bound_state.texture = textureName(vao->Texture);
+		glBindTexture(textureTarget(vao->Texture), bound_state.texture);
+	}
+
+	for (int i=0; i<4; i++)
+		glVertexAttribPointer(3 + i, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(instance_offset + i*sizeof(glm::vec4)));
+
+	// Draw the geometry from where the mesh sits in the page
+	glDrawArraysInstanced(vao->PrimitiveMode, vao->FirstVertex, vao->NumVertices, instances);
+}
+
+void draw3DTexturedObject (MeshHandle handle, const glm::mat4& MVP)
+{
+	struct VAO* vao = meshGet(handle);
+	if (!vao)
+		return;
+
+	// The texture variant is not instanced, it takes the MVP as a uniform
+	ShaderVariant& shader = useShader(vao->Shader);
+	glUniformMatrix4fv(shader.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+
+	// Change the Fill Mode for this object
+	glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+	bound_state.fill_mode = vao->FillMode;
+
+	// Bind the VAO to use
+	glBindVertexArray (vao->VertexArrayID);
+	bound_state.vertex_array = vao->VertexArrayID;
+
+	// Bind Textures using texture units, the placeholder until it has loaded
+	glBindTexture(GL_TEXTURE_2D, textureName(vao->Texture));
+
+	// Draw the geometry !
+	glDrawArrays(vao->PrimitiveMode, vao->FirstVertex, vao->NumVertices);
+
+	// Unbind Textures to be safe
+	glBindTexture(GL_TEXTURE_2D, 0);
+	bound_state.texture = 0;
+}
+
+/**************
+ * Job System *
+ **************/
+
+/* Work stealing thread pool. A JobGraph holds the jobs of one frame and the
+   dependency edges between them; a job is queued once every job it depends on
+   has finished. Graphs are fixed size and rebuilt every frame, so building and
+   running them never touches the heap. No GL calls are allowed inside jobs. */
+
+#define MAX_GRAPH_JOBS 512
+#define MAX_GRAPH_EDGES 2048
+#define JOB_QUEUE_SIZE 1024 // power of 2
+
+typedef void (*JobFunction) (void* data, int begin, int end);
+
+struct JobGraph;
+
+struct Job {
+	JobFunction function;
+	void* data;
+	int begin, end; // range handed to function, used by jobParallelFor
+	int first_edge; // head of this job's successor list in graph->edges
+	std::atomic<int> pending; // dependencies that have not finished yet
+	JobGraph* graph;
+};
+
+struct JobEdge {
+	int job;
+	int next;
+};
+
+struct JobGraph {
+	Job jobs[MAX_GRAPH_JOBS];
+	JobEdge edges[MAX_GRAPH_EDGES];
+	int job_count;
+	int edge_count;
+	std::atomic<int> remaining;
+#ifdef ALLOC_AUDIT
+	bool audit; // jobs are audited when the thread running the graph is
+#endif
+};
+
+/* Owner pushes and pops at bottom, thieves take from top */
+struct JobQueue {
+	std::mutex lock;
+	Job* ring[JOB_QUEUE_SIZE];
+	unsigned int top, bottom;
+};
+
+/* Long jobs outside any graph, like decoding a texture. Only pool workers
+   take them, and only with no frame job waiting, so a thread waiting in
+   jobRun() never gets stuck in one */
+struct BackgroundJob {
+	JobFunction function;
+	void* data;
+};
+
+struct JobSystem {
+	vector<std::thread> workers;
+	JobQueue* queues; // queue 0 is shared by every thread outside the pool
+	int queue_count;
+	std::atomic<bool> running;
+	std::atomic<int> queued;
+	std::atomic<int> sleeping;
+	std::mutex background_lock;
+	std::deque<BackgroundJob> background;
+	std::atomic<int> background_queued;
+	std::mutex sleep_lock;
+	std::condition_variable wake;
+} Jobs;
+
+thread_local int job_queue_index = 0;
+
+void jobNop (void* data, int begin, int end)
+{
+}
+
+bool jobPush (Job* job)
+{
+	JobQueue& q = Jobs.queues[job_queue_index];
+	{
+		std::lock_guard<std::mutex> guard(q.lock);
+		if (q.bottom - q.top == JOB_QUEUE_SIZE)
+			return false;
+		q.ring[q.bottom++ % JOB_QUEUE_SIZE] = job;
+	}
+	Jobs.queued++;
+	if (Jobs.sleeping > 0) {
+		{ std::lock_guard<std::mutex> guard(Jobs.sleep_lock); }
+		Jobs.wake.notify_one();
+	}
+	return true;
+}
+
+Job* jobPop (int index, bool steal)
+{
+	JobQueue& q = Jobs.queues[index];
+	std::lock_guard<std::mutex> guard(q.lock);
+	if (q.bottom == q.top)
+		return NULL;
+	Jobs.queued--;
+	if (steal)
+		return q.ring[q.top++ % JOB_QUEUE_SIZE];
+	return q.ring[--q.bottom % JOB_QUEUE_SIZE];
+}
+
+/* Own queue first (most recently pushed, still warm in cache), then steal */
+Job* jobFind ()
+{
+	Job* job = jobPop(job_queue_index, false);
+	for (int i=1; !job && i<Jobs.queue_count; i++)
+		job = jobPop((job_queue_index + i) % Jobs.queue_count, true);
+	return job;
+}
+
+void jobExecute (Job* job)
+{
+	JobGraph* graph = job->graph;
+	ALLOC_AUDIT_FRAME(graph->audit);
+	job->function(job->data, job->begin, job->end);
+
+	for (int e = job->first_edge; e != -1; e = graph->edges[e].next) {
+		Job* next = &graph->jobs[graph->edges[e].job];
+		if (--next->pending == 0 && !jobPush(next))
+			jobExecute(next); // queue full, run it here
+	}
+	// Must stay the last access to the graph, the waiting thread may reuse it right after
+	graph->remaining--;
+}
+
+bool jobRunBackground ()
+{
+	BackgroundJob job;
+	{
+		std::lock_guard<std::mutex> guard(Jobs.background_lock);
+		if (Jobs.background.empty())
+			return false;
+		job = Jobs.background.front();
+		Jobs.background.pop_front();
+		Jobs.background_queued--;
+	}
+	job.function(job.data, 0, 0);
+	return true;
+}
+
+void jobWorker (int index)
+{
+	job_queue_index = index;
+	char name[32];
+	snprintf(name, sizeof(name), "worker %d", index);
+	profileThreadBegin(name);
+	while (Jobs.running) {
+		Job* job = jobFind();
+		if (job) {
+			jobExecute(job);
+			continue;
+		}
+		if (jobRunBackground())
+			continue;
+		std::unique_lock<std::mutex> guard(Jobs.sleep_lock);
+		Jobs.sleeping++;
+		Jobs.wake.wait(guard, [] { return Jobs.queued > 0 || Jobs.background_queued > 0 || !Jobs.running; });
+		Jobs.sleeping--;
+	}
+}
+
+/* Start the pool, by default one worker per core besides the calling thread */
+void jobInit (int workers=-1)
+{
+	if (workers < 0)
+		workers = max((int)std::thread::hardware_concurrency() - 1, 0);
+
+	Jobs.queue_count = workers + 1;
+	Jobs.queues = new JobQueue[Jobs.queue_count];
+	for (int i=0; i<Jobs.queue_count; i++)
+		Jobs.queues[i].top = Jobs.queues[i].bottom = 0;
+	Jobs.running = true;
+	Jobs.queued = 0;
+	Jobs.sleeping = 0;
+	Jobs.background_queued = 0;
+
+	for (int i=1; i<=workers; i++)
+		Jobs.workers.push_back(std::thread(jobWorker, i));
+}
+
+void jobShutdown ()
+{
+	Jobs.running = false;
+	{ std::lock_guard<std::mutex> guard(Jobs.sleep_lock); }
+	Jobs.wake.notify_all();
+	for (int i=0; i<Jobs.workers.size(); i++)
+		Jobs.workers[i].join();
+	Jobs.workers.clear();
+	Jobs.background.clear(); // never started
+	delete[] Jobs.queues;
+}
+
+/* Queue a background job; without any worker it runs right here */
+void jobBackground (JobFunction function, void* data)
+{
+	if (Jobs.workers.empty()) {
+		function(data, 0, 0);
+		return;
+	}
+	BackgroundJob job = { function, data };
+	{
+		std::lock_guard<std::mutex> guard(Jobs.background_lock);
+		Jobs.background.push_back(job);
+		Jobs.background_queued++;
+	}
+	{ std::lock_guard<std::mutex> guard(Jobs.sleep_lock); }
+	Jobs.wake.notify_one();
+}
+
+void jobGraphReset (JobGraph& graph)
+{
+	graph.job_count = 0;
+	graph.edge_count = 0;
+	graph.remaining = 0;
+}
+
+int jobAdd (JobGraph& graph, JobFunction function, void* data, int begin=0, int end=0)
+{
+	if (graph.job_count == MAX_GRAPH_JOBS) {
+		logPrint(LOG_ERROR, "Job graph is full");
+		exit(EXIT_FAILURE);
+	}
+	int id = graph.job_count++;
+	Job& job = graph.jobs[id];
+	job.function = function;
+	job.data = data;
+	job.begin = begin;
+	job.end = end;
+	job.first_edge = -1;
+	job.pending = 0;
+	job.graph = &graph;
+	return id;
+}
+
+/* 'job' will not start before 'dependency' has finished */
+void jobDepend (JobGraph& graph, int job, int dependency)
+{
+	if (graph.edge_count == MAX_GRAPH_EDGES) {
+		logPrint(LOG_ERROR, "Job graph has too many dependencies");
+		exit(EXIT_FAILURE);
+	}
+	int e = graph.edge_count++;
+	graph.edges[e].job = job;
+	graph.edges[e].next = graph.jobs[dependency].first_edge;
+	graph.jobs[dependency].first_edge = e;
+	graph.jobs[job].pending++;
+}
+
+/* Split [0,count) into chunks of at least 'grain' items. Returns a join job that
+   finishes after every chunk, so later jobs can depend on the whole loop */
+int jobParallelFor (JobGraph& graph, JobFunction function, void* data, int count, int grain, const int* deps=NULL, int dep_count=0)
+{
+	int join = jobAdd(graph, jobNop, NULL);
+	int chunks = min((count + grain - 1) / grain, Jobs.queue_count * 4);
+	for (int c=0; c<chunks; c++) {
+		int chunk = jobAdd(graph, function, data, (long long)count*c/chunks, (long long)count*(c+1)/chunks);
+		for (int d=0; d<dep_count; d++)
+			jobDepend(graph, chunk, deps[d]);
+		jobDepend(graph, join, chunk);
+	}
+	if (chunks == 0)
+		for (int d=0; d<dep_count; d++)
+			jobDepend(graph, join, deps[d]);
+	return join;
+}
+
+/* Run the graph to completion, the calling thread works on jobs while it waits */
+void jobRun (JobGraph& graph)
+{
+	// Collect roots before queueing any, a running job may release another one meanwhile
+	int roots[MAX_GRAPH_JOBS], root_count = 0;
+	for (int i=0; i<graph.job_count; i++)
+		if (graph.jobs[i].pending == 0)
+			roots[root_count++] = i;
+
+	graph.remaining = graph.job_count;
+#ifdef ALLOC_AUDIT
+	graph.audit = alloc_audit_depth > 0;
+#endif
+	for (int i=0; i<root_count; i++)
+		if (!jobPush(&graph.jobs[roots[i]]))
+			jobExecute(&graph.jobs[roots[i]]);
+
+	while (graph.remaining > 0) {
+		Job* job = jobFind();
+		if (job)
+			jobExecute(job);
+		else
+			std::this_thread::yield();
+	}
+}
+
+
+/******************
+ * Baked Textures *
+ ******************/
+
+/* --bake decodes every PNG the game uses, builds the mip chain on the CPU
+   and writes it as a KTX file next to the PNG (beach2.png -> beach2.ktx).
+   The levels are compressed by the driver (S3TC, else ETC2) when it can,
+   unless --bake-uncompressed is given. At runtime a KTX file at least as new
+   as its PNG is mapped and its levels go to the GPU as they are */
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
+#define MAX_COMPRESSED_FORMATS 64
+
+const char* texture_files[] = { "beach.png", "beach2.png" };
+
+const unsigned char ktx_identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+struct KtxHeader {
+	unsigned char identifier[12];
+	unsigned int endianness; // 0x04030201 as written
+	unsigned int glType, glTypeSize, glFormat; // glType 0 for compressed data
+	unsigned int glInternalFormat, glBaseInternalFormat;
+	unsigned int pixelWidth, pixelHeight, pixelDepth;
+	unsigned int numberOfArrayElements, numberOfFaces, numberOfMipmapLevels;
+	unsigned int bytesOfKeyValueData;
+};
+
+// Filled by textureStreamInit(), read only afterwards so decode jobs can check
+GLint compressed_formats[MAX_COMPRESSED_FORMATS];
+int compressed_format_count = 0;
+
+bool compressedFormatSupported (GLenum format)
+{
+	for (int i=0; i<compressed_format_count; i++)
+		if (compressed_formats[i] == format)
+			return true;
+	return false;
+}
+
+void compressedFormatsInit ()
+{
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_COMPRESSED_TEXTURE_FORMATS, &count);
+	vector<GLint> formats(max(count, 1));
+	glGetIntegerv(GL_COMPRESSED_TEXTURE_FORMATS, &formats[0]);
+	compressed_format_count = min((int)count, MAX_COMPRESSED_FORMATS);
+	for (int i=0; i<compressed_format_count; i++)
+		compressed_formats[i] = formats[i];
+}
+
+string bakedTexturePath (const char* filename)
+{
+	string path = filename;
+	size_t dot = path.rfind('.');
+	if (dot != string::npos)
+		path.resize(dot);
+	return path + ".ktx";
+}
+
+int mipLevelCount (int width, int height)
+{
+	int levels = 1;
+	while (max(width, height) >> levels)
+		levels++;
+	return levels;
+}
+
+/* Halve an RGB image with a 2x2 box filter, odd edges repeat the last texel */
+void mipDownsample (const unsigned char* src, int width, int height, unsigned char* dst)
+{
+	int dst_width = max(width/2, 1), dst_height = max(height/2, 1);
+	for (int y=0; y<dst_height; y++)
+		for (int x=0; x<dst_width; x++) {
+			int x0 = min(2*x, width-1), x1 = min(2*x+1, width-1);
+			int y0 = min(2*y, height-1), y1 = min(2*y+1, height-1);
+			for (int c=0; c<3; c++) {
+				int sum = src[(y0*width + x0)*3 + c] + src[(y0*width + x1)*3 + c]
+					+ src[(y1*width + x0)*3 + c] + src[(y1*width + x1)*3 + c];
+				dst[(y*dst_width + x)*3 + c] = (sum + 2) / 4;
+			}
+		}
+}
+
+/* Needs the GL context; the driver does the compression */
+bool bakeTexture (const char* filename, bool compress)
+{
+	PROFILE_ZONE("bakeTexture");
+	int width, height;
+	unsigned char* image = loadImage(filename, &width, &height);
+	if (!image) {
+		logPrint(LOG_ERROR, "SOIL loading error: '%s' for %s", SOIL_last_result(), filename);
+		return false;
+	}
 
-	GLenum PrimitiveMode; // GL_POINTS, GL_LINE_STRIP, GL_LINE_LOOP, GL_LINES, GL_LINE_STRIP_ADJACENCY, GL_LINES_ADJACENCY, GL_TRIANGLE_STRIP, GL_TRIANGLE_FAN, GL_TRIANGLES, GL_TRIANGLE_STRIP_ADJACENCY and GL_TRIANGLES_ADJACENCY
-	GLenum FillMode; // GL_FILL, GL_LINE
-	int NumVertices;
+	GLenum format = 0;
+	if (compress && compressedFormatSupported(GL_COMPRESSED_RGB_S3TC_DXT1_EXT))
+		format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	else if (compress && compressedFormatSupported(GL_COMPRESSED_RGB8_ETC2))
+		format = GL_COMPRESSED_RGB8_ETC2;
+
+	KtxHeader header;
+	memcpy(header.identifier, ktx_identifier, sizeof(ktx_identifier));
+	header.endianness = 0x04030201;
+	header.glType = format ? 0 : GL_UNSIGNED_BYTE;
+	header.glTypeSize = 1;
+	header.glFormat = format ? 0 : GL_RGB;
+	header.glInternalFormat = format ? format : GL_RGB8;
+	header.glBaseInternalFormat = GL_RGB;
+	header.pixelWidth = width;
+	header.pixelHeight = height;
+	header.pixelDepth = 0;
+	header.numberOfArrayElements = 0;
+	header.numberOfFaces = 1;
+	header.numberOfMipmapLevels = mipLevelCount(width, height);
+	header.bytesOfKeyValueData = 0;
+
+	GLuint texture = 0;
+	if (format) {
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	}
+
+	string data((const char*)&header, sizeof(header));
+	vector<unsigned char> level(image, image + width*height*3), next;
+	vector<unsigned char> level_data;
+	int level_width = width, level_height = height;
+	for (int i=0; i<header.numberOfMipmapLevels; i++) {
+		if (format) {
+			// Let the driver compress the level and read it back
+			GLint size = 0;
+			glTexImage2D(GL_TEXTURE_2D, i, format, level_width, level_height, 0, GL_RGB, GL_UNSIGNED_BYTE, &level[0]);
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, i, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+			level_data.resize(size);
+			glGetCompressedTexImage(GL_TEXTURE_2D, i, &level_data[0]);
+		} else {
+			// KTX rows are padded to 4 bytes, as GL_UNPACK_ALIGNMENT 4 expects
+			int row_bytes = level_width*3, padded = (row_bytes + 3) & ~3;
+			level_data.assign((size_t)padded*level_height, 0);
+			for (int y=0; y<level_height; y++)
+				memcpy(&level_data[(size_t)y*padded], &level[(size_t)y*row_bytes], row_bytes);
+		}
+		unsigned int size = level_data.size();
+		data.append((const char*)&size, sizeof(size));
+		data.append((const char*)&level_data[0], size);
+		data.append((4 - size % 4) % 4, '\0');
+
+		if (i + 1 < header.numberOfMipmapLevels) {
+			next.resize(max(level_width/2, 1) * max(level_height/2, 1) * 3);
+			mipDownsample(&level[0], level_width, level_height, &next[0]);
+			level.swap(next);
+			level_width = max(level_width/2, 1);
+			level_height = max(level_height/2, 1);
+		}
+	}
+	SOIL_free_image_data(image);
+	if (format) {
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glDeleteTextures(1, &texture);
+	}
+
+	string path = bakedTexturePath(filename);
+	std::ofstream out(path.c_str(), std::ios::binary);
+	out.write(data.data(), data.size());
+	if (!out) {
+		logPrint(LOG_ERROR, "Could not write %s", path.c_str());
+		return false;
+	}
+	logPrint(LOG_INFO, "Baked %s to %s, %d levels, %s, %d KB", filename, path.c_str(), (int)header.numberOfMipmapLevels,
+		format ? "compressed" : "uncompressed", (int)(data.size()/1024));
+	return true;
+}
+
+bool bakeTextures (bool compress)
+{
+	compressedFormatsInit();
+	bool baked = true;
+	for (int i=0; i<sizeof(texture_files)/sizeof(texture_files[0]); i++)
+		baked = bakeTexture(texture_files[i], compress) && baked;
+	return baked;
+}
+
+/* Whether a KTX file can be uploaded as it is */
+/* Bytes a level of the formats bakeTexture() writes takes, 0 for any other
+   format. Uncompressed rows are padded to 4 bytes, the default unpack
+   alignment; DXT1 and ETC2 store 8 bytes per 4x4 block */
+size_t ktxLevelSize (const KtxHeader* ktx, int level)
+{
+	size_t width = max(ktx->pixelWidth >> level, 1u), height = max(ktx->pixelHeight >> level, 1u);
+	if (ktx->glType == GL_UNSIGNED_BYTE && ktx->glFormat == GL_RGB && ktx->glInternalFormat == GL_RGB8)
+		return ((width*3 + 3) & ~(size_t)3) * height;
+	if (ktx->glType == 0 && ktx->glFormat == 0 && (ktx->glInternalFormat == GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+		|| ktx->glInternalFormat == GL_COMPRESSED_RGB8_ETC2))
+		return ((width + 3) / 4) * ((height + 3) / 4) * 8;
+	return 0;
+}
+
+bool ktxUsable (const KtxHeader* ktx, size_t size)
+{
+	bool usable = size >= sizeof(KtxHeader) && !memcmp(ktx->identifier, ktx_identifier, sizeof(ktx_identifier))
+		&& ktx->endianness == 0x04030201 && ktx->pixelDepth == 0 && ktx->numberOfArrayElements == 0
+		&& ktx->pixelWidth > 0 && ktx->pixelHeight > 0 && ktx->pixelWidth <= 16384 && ktx->pixelHeight <= 16384
+		&& ktx->numberOfFaces == 1 && ktx->numberOfMipmapLevels == mipLevelCount(ktx->pixelWidth, ktx->pixelHeight)
+		&& ktxLevelSize(ktx, 0) != 0 && (ktx->glType != 0 || compressedFormatSupported(ktx->glInternalFormat));
+
+	// Every level must be the size its dimensions need and lie inside the file,
+	// the upload reads as much as the header says
+	size_t offset = sizeof(KtxHeader) + (size_t)ktx->bytesOfKeyValueData;
+	for (int i=0; usable && i<ktx->numberOfMipmapLevels; i++) {
+		unsigned int level_size = 0;
+		usable = offset + sizeof(level_size) <= size;
+		if (usable)
+			memcpy(&level_size, (const char*)ktx + offset, sizeof(level_size));
+		usable = usable && level_size == ktxLevelSize(ktx, i);
+		offset += sizeof(level_size) + ((level_size + 3) & ~(size_t)3);
+		usable = usable && offset <= size;
+	}
+	return usable;
+}
+
+/* Find a baked texture, in the pack or mapped from its own file (mapped is
+   then set), and check it can be uploaded as it is. Runs on the decode job,
+   so no GL calls */
+const KtxHeader* mapBakedTexture (const char* filename, size_t& size, bool& mapped_file)
+{
+	string path = bakedTexturePath(filename);
+	mapped_file = false;
+	const KtxHeader* packed = (const KtxHeader*) packView(path.c_str(), size);
+	if (packed && ktxUsable(packed, size))
+		return packed;
+
+	struct stat baked, source;
+	if (stat(path.c_str(), &baked) != 0)
+		return NULL;
+	if (stat(filename, &source) == 0 && source.st_mtime > baked.st_mtime) {
+		logPrint(LOG_WARN, "%s is older than %s, decoding the PNG", path.c_str(), filename);
+		return NULL;
+	}
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	size = baked.st_size;
+	void* mapped = size >= sizeof(KtxHeader) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (mapped == MAP_FAILED)
+		return NULL;
+
+	const KtxHeader* ktx = (const KtxHeader*) mapped;
+	if (!ktxUsable(ktx, size)) {
+		logPrint(LOG_WARN, "Ignoring %s, not a KTX file this driver can use", path.c_str());
+		munmap(mapped, size);
+		return NULL;
+	}
+	mapped_file = true;
+	return ktx;
+}
+
+
+/*********************
+ * Texture Streaming *
+ *********************/
+
+/* createTexture() returns at once. A background job decodes the image and
+   textureStreamFrame(), between frames on the GL thread, uploads it through
+   a pixel buffer object a band of rows at a time, at most
+   TEXTURE_UPLOAD_BUDGET bytes per frame. A baked texture is only mapped by
+   the job and uploaded a mip level at a time straight from the mapping.
+   Until the last band or level is in, textureName() gives the placeholder.
+
+   createTextureArray() packs several images into the layers of one
+   GL_TEXTURE_2D_ARRAY, so meshes using any of them draw with one binding.
+   Layers share a size; the job scales every image to the largest one */
+
+#define MAX_TEXTURES 32
+#define MAX_TEXTURE_LAYERS 16
+#define TEXTURE_UPLOAD_BUDGET (256*1024) // bytes per frame
+
+enum TextureState { TEXTURE_DECODING, TEXTURE_DECODED, TEXTURE_READY, TEXTURE_FAILED };
+
+struct StreamedTexture {
+	const char* filename; // the first layer's for an array
+	const char* layer_files[MAX_TEXTURE_LAYERS];
+	int layers; // 0 for a plain 2D texture
+	GLenum target;
+	std::atomic<int> state;
+	unsigned char* image; // set by the decode job, freed after the upload
+	const KtxHeader* ktx; // or the baked texture, unmapped after it if ktx_mapped
+	size_t ktx_size;
+	bool ktx_mapped; // its own file, not in the pack
+	const unsigned char* next_level; // size and data of the next KTX level
+	int width, height;
+	int rows_uploaded, levels_uploaded; // rows of all layers
+	GLuint texture; // made with the first band
 };
-typedef struct VAO VAO;
 
-vector<VAO*>arr_block1;
-vector<glm::vec3>block1;
+struct TextureStream {
+	StreamedTexture textures[MAX_TEXTURES];
+	int count;
+	GLuint placeholder, placeholder_array;
+	GLuint pbo;
+	long long uploaded_bytes;
+} texture_stream;
 
-vector<glm::vec3>block2;
-vector<glm::vec3>block4;
-vector<glm::vec3>block5;
+void jobDecodeTexture (void* data, int begin, int end)
+{
+	PROFILE_ZONE("decodeTexture");
+	StreamedTexture* texture = (StreamedTexture*) data;
+	texture->ktx = mapBakedTexture(texture->filename, texture->ktx_size, texture->ktx_mapped);
+	if (texture->ktx) {
+		texture->width = texture->ktx->pixelWidth;
+		texture->height = texture->ktx->pixelHeight;
+		texture->next_level = (const unsigned char*)(texture->ktx + 1) + texture->ktx->bytesOfKeyValueData;
+		texture->state = TEXTURE_DECODED;
+		return;
+	}
+	texture->image = loadImage(texture->filename, &texture->width, &texture->height);
+	texture->state = texture->image ? TEXTURE_DECODED : TEXTURE_FAILED;
+}
 
+/* Bilinear scale of an RGB image */
+void resampleImage (const unsigned char* src, int src_width, int src_height, unsigned char* dst, int width, int height)
+{
+	for (int y=0; y<height; y++) {
+		float sy = max((y + 0.5f) * src_height / height - 0.5f, 0.0f);
+		int y0 = min((int)sy, src_height-1), y1 = min(y0+1, src_height-1);
+		float fy = sy - y0;
+		for (int x=0; x<width; x++) {
+			float sx = max((x + 0.5f) * src_width / width - 0.5f, 0.0f);
+			int x0 = min((int)sx, src_width-1), x1 = min(x0+1, src_width-1);
+			float fx = sx - x0;
+			for (int c=0; c<3; c++) {
+				float top = src[(y0*src_width + x0)*3 + c]*(1-fx) + src[(y0*src_width + x1)*3 + c]*fx;
+				float bottom = src[(y1*src_width + x0)*3 + c]*(1-fx) + src[(y1*src_width + x1)*3 + c]*fx;
+				dst[(y*width + x)*3 + c] = (unsigned char)(top*(1-fy) + bottom*fy + 0.5f);
+			}
+		}
+	}
+}
 
-vector<VAO*>arr_block3;
-vector<glm::vec3>block3;
+/* Decode every layer and pack them, one after the other, into one image */
+void jobDecodeTextureArray (void* data, int begin, int end)
+{
+	PROFILE_ZONE("decodeTextureArray");
+	StreamedTexture* texture = (StreamedTexture*) data;
+	unsigned char* images[MAX_TEXTURE_LAYERS];
+	int widths[MAX_TEXTURE_LAYERS], heights[MAX_TEXTURE_LAYERS];
+	int width = 1, height = 1;
+	bool decoded = true;
+	for (int i=0; i<texture->layers; i++) {
+		images[i] = loadImage(texture->layer_files[i], &widths[i], &heights[i]);
+		if (!images[i]) {
+			logPrint(LOG_ERROR, "SOIL loading error: '%s'", texture->layer_files[i]);
+			decoded = false;
+			continue;
+		}
+		width = max(width, widths[i]);
+		height = max(height, heights[i]);
+	}
 
-struct GLMatrices {
-	glm::mat4 projection;
-	glm::mat4 model;
-	glm::mat4 view;
-	GLuint MatrixID; // For use with normal shader
-	GLuint TexMatrixID; // For use with texture shader
-} Matrices;
+	size_t layer_bytes = (size_t)width*height*3;
+	texture->image = decoded ? (unsigned char*) malloc(layer_bytes*texture->layers) : NULL;
+	for (int i=0; i<texture->layers; i++) {
+		if (!images[i])
+			continue;
+		if (texture->image && widths[i] == width && heights[i] == height)
+			memcpy(texture->image + layer_bytes*i, images[i], layer_bytes);
+		else if (texture->image)
+			resampleImage(images[i], widths[i], heights[i], texture->image + layer_bytes*i, width, height);
+		SOIL_free_image_data(images[i]);
+	}
+	texture->width = width;
+	texture->height = height;
+	texture->state = texture->image ? TEXTURE_DECODED : TEXTURE_FAILED;
+}
 
-struct FTGLFont {
-	FTFont* font;
-	GLuint fontMatrixID;
-	GLuint fontColorID;
-} GL3Font;
+void setTextureParameters (GLenum target)
+{
+	// Set texture wrapping to GL_REPEAT
+	glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	// Set texture filtering (interpolation)
+	glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+}
 
-GLuint programID, fontProgramID, textureProgramID;
+void textureStreamInit ()
+{
+	// 2x2 checkers, drawn until a texture is loaded
+	const unsigned char checkers[12] = { 255,0,255, 64,64,64, 64,64,64, 255,0,255 };
+	glGenTextures(1, &texture_stream.placeholder);
+	glBindTexture(GL_TEXTURE_2D, texture_stream.placeholder);
+	setTextureParameters(GL_TEXTURE_2D);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 2, 2, 0, GL_RGB, GL_UNSIGNED_BYTE, checkers);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	resourceAdd(RES_TEXTURE, texture_stream.placeholder, 2*2*3);
+
+	// The same as a single layer array
+	glGenTextures(1, &texture_stream.placeholder_array);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, texture_stream.placeholder_array);
+	setTextureParameters(GL_TEXTURE_2D_ARRAY);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGB, 2, 2, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, checkers);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	resourceAdd(RES_TEXTURE, texture_stream.placeholder_array, 2*2*3);
+
+	glGenBuffers(1, &texture_stream.pbo);
+	resourceAdd(RES_BUFFER, texture_stream.pbo, TEXTURE_UPLOAD_BUDGET);
+
+	compressedFormatsInit();
+}
 
-/* Function to load Shaders - Use it as it is */
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+StreamedTexture* newTexture (const char* filename)
+{
+	if (texture_stream.count == MAX_TEXTURES) {
+		logPrint(LOG_ERROR, "Too many textures, %s is not loaded", filename);
+		return NULL;
+	}
+	StreamedTexture& texture = texture_stream.textures[texture_stream.count++];
+	texture.filename = filename;
+	texture.layers = 0;
+	texture.target = GL_TEXTURE_2D;
+	texture.state = TEXTURE_DECODING;
+	texture.image = NULL;
+	texture.ktx = NULL;
+	texture.rows_uploaded = 0;
+	texture.levels_uploaded = 0;
+	texture.texture = 0;
+	return &texture;
+}
 
-	// Create the shaders
-	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+/* Start loading an image file as an OpenGL texture, returns its index */
+int createTexture (const char* filename)
+{
+	PROFILE_ZONE("createTexture");
+	StreamedTexture* texture = newTexture(filename);
+	if (!texture)
+		return -1;
+	jobBackground(jobDecodeTexture, texture);
+	return texture - texture_stream.textures;
+}
+
+/* Start loading image files as the layers of one array texture, in order */
+int createTextureArray (const char* const* filenames, int layers)
+{
+	PROFILE_ZONE("createTexture");
+	StreamedTexture* texture = layers > 0 && layers <= MAX_TEXTURE_LAYERS ? newTexture(filenames[0]) : NULL;
+	if (!texture)
+		return -1;
+	texture->layers = layers;
+	texture->target = GL_TEXTURE_2D_ARRAY;
+	for (int i=0; i<layers; i++)
+		texture->layer_files[i] = filenames[i];
+	jobBackground(jobDecodeTextureArray, texture);
+	return texture - texture_stream.textures;
+}
+
+GLenum textureTarget (int texture)
+{
+	if (texture < 0 || texture >= texture_stream.count)
+		return GL_TEXTURE_2D;
+	return texture_stream.textures[texture].target;
+}
+
+GLuint textureName (int texture)
+{
+	if (texture < 0 || texture >= texture_stream.count || texture_stream.textures[texture].state != TEXTURE_READY)
+		return textureTarget(texture) == GL_TEXTURE_2D_ARRAY ? texture_stream.placeholder_array : texture_stream.placeholder;
+	return texture_stream.textures[texture].texture;
+}
+
+/* Copy the next rows of one decoded image into its texture, returns the bytes sent */
+long long uploadTextureRows (StreamedTexture& texture, long long budget)
+{
+	GLenum target = texture.target;
+	int row_bytes = texture.width * 3;
+	int layers = max(texture.layers, 1);
+	if (!texture.texture) {
+		// Generate Texture Buffer, sized for the whole image
+		glGenTextures(1, &texture.texture);
+		glBindTexture(target, texture.texture);
+		setTextureParameters(target);
+		if (target == GL_TEXTURE_2D_ARRAY)
+			glTexImage3D(target, 0, GL_RGB, texture.width, texture.height, layers, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+		else
+			glTexImage2D(target, 0, GL_RGB, texture.width, texture.height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+		// Textures outlive the level that happened to load them
+		int scope = registry.scope;
+		resourceScope(SCOPE_GLOBAL);
+		resourceAdd(RES_TEXTURE, texture.texture, (long long)row_bytes*texture.height*layers*4/3); // a full mip chain adds a third
+		resourceScope(scope);
+	}
+
+	// A band never crosses into the next layer
+	int layer = texture.rows_uploaded / texture.height, row = texture.rows_uploaded % texture.height;
+	int rows = min(texture.height - row, max(int(budget / row_bytes), 1));
+	GLsizeiptr size = (GLsizeiptr)rows * row_bytes;
+
+	// Orphan the buffer so the driver never waits for the last upload from it
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, texture_stream.pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, max(size, (GLsizeiptr)TEXTURE_UPLOAD_BUDGET), NULL, GL_STREAM_DRAW);
+	void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (mapped) {
+		memcpy(mapped, texture.image + (long long)texture.rows_uploaded * row_bytes, size);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glBindTexture(target, texture.texture);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		if (target == GL_TEXTURE_2D_ARRAY)
+			glTexSubImage3D(target, 0, 0, row, layer, texture.width, rows, 1, GL_RGB, GL_UNSIGNED_BYTE, 0);
+		else
+			glTexSubImage2D(target, 0, 0, row, texture.width, rows, GL_RGB, GL_UNSIGNED_BYTE, 0);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		texture.rows_uploaded += rows;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	if (texture.rows_uploaded == texture.height*layers) {
+		glGenerateMipmap(target); // Generate MipMaps to use
+		// Free the data read from file after creating opengl texture
+		if (texture.layers)
+			free(texture.image);
+		else
+			SOIL_free_image_data(texture.image);
+		texture.image = NULL;
+		texture.state = TEXTURE_READY;
+		if (texture.layers)
+			logPrint(LOG_INFO, "Loaded texture %s (%dx%d, %d layers)", texture.filename, texture.width, texture.height, texture.layers);
+		else
+			logPrint(LOG_INFO, "Loaded texture %s (%dx%d)", texture.filename, texture.width, texture.height);
+	}
+	glBindTexture(target, 0); // Unbind texture when done, so we won't accidentily mess it up
+	return size;
+}
+
+/* Send the next levels of a baked texture, at least one; returns the bytes sent */
+long long uploadTextureLevels (StreamedTexture& texture, long long budget)
+{
+	const KtxHeader* ktx = texture.ktx;
+	if (!texture.texture) {
+		glGenTextures(1, &texture.texture);
+		glBindTexture(GL_TEXTURE_2D, texture.texture);
+		setTextureParameters(GL_TEXTURE_2D);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, ktx->numberOfMipmapLevels - 1);
+		int scope = registry.scope;
+		resourceScope(SCOPE_GLOBAL);
+		resourceAdd(RES_TEXTURE, texture.texture, texture.ktx_size - sizeof(KtxHeader));
+		resourceScope(scope);
+	}
+	glBindTexture(GL_TEXTURE_2D, texture.texture);
+
+	long long sent = 0;
+	while (texture.levels_uploaded < ktx->numberOfMipmapLevels && (sent == 0 || sent < budget)) {
+		int level = texture.levels_uploaded++;
+		int width = max(texture.width >> level, 1), height = max(texture.height >> level, 1);
+		unsigned int size;
+		memcpy(&size, texture.next_level, sizeof(size));
+		const unsigned char* data = texture.next_level + sizeof(size);
+		if (ktx->glType == 0)
+			glCompressedTexImage2D(GL_TEXTURE_2D, level, ktx->glInternalFormat, width, height, 0, size, data);
+		else
+			glTexImage2D(GL_TEXTURE_2D, level, ktx->glInternalFormat, width, height, 0, ktx->glFormat, ktx->glType, data);
+		texture.next_level = data + ((size + 3) & ~3u);
+		sent += size;
+	}
+
+	if (texture.levels_uploaded == ktx->numberOfMipmapLevels) {
+		if (texture.ktx_mapped)
+			munmap((void*)ktx, texture.ktx_size);
+		texture.ktx = NULL;
+		texture.state = TEXTURE_READY;
+		logPrint(LOG_INFO, "Loaded texture %s (%dx%d)", bakedTexturePath(texture.filename).c_str(), texture.width, texture.height);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return sent;
+}
+
+/* GL thread, between frames */
+void textureStreamFrame ()
+{
+	long long budget = TEXTURE_UPLOAD_BUDGET;
+	for (int i=0; i<texture_stream.count && budget > 0; i++) {
+		StreamedTexture& texture = texture_stream.textures[i];
+		int state = texture.state;
+		if (state == TEXTURE_FAILED && texture.filename) {
+			logPrint(LOG_ERROR, "SOIL loading error: '%s'", texture.filename);
+			texture.filename = NULL; // reported, keeps the placeholder
+		}
+		if (state != TEXTURE_DECODED)
+			continue;
+		PROFILE_ZONE("uploadTexture");
+		long long bytes = texture.ktx ? uploadTextureLevels(texture, budget) : uploadTextureRows(texture, budget);
+		budget -= bytes;
+		texture_stream.uploaded_bytes += bytes;
+	}
+}
+
+
+/***************
+ * Input Queue *
+ ***************/
 
-	// Read the Vertex Shader code from the file
-	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if(VertexShaderStream.is_open())
+/* Lock free ring for one producer and one consumer thread; neither side ever
+   blocks, push() fails when the ring is full. N must be a power of 2 */
+template <typename T, unsigned int N>
+struct SpscRing {
+	T ring[N];
+	alignas(64) std::atomic<unsigned int> head; // next item to read, consumer only
+	alignas(64) std::atomic<unsigned int> tail; // next free slot, producer only
+
+	bool push (const T& item)
 	{
-		std::string Line = "";
-		while(getline(VertexShaderStream, Line))
-			VertexShaderCode += "\n" + Line;
-		VertexShaderStream.close();
+		unsigned int t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == N)
+			return false;
+		ring[t % N] = item;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
 	}
 
-	// Read the Fragment Shader code from the file
-	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if(FragmentShaderStream.is_open()){
-		std::string Line = "";
-		while(getline(FragmentShaderStream, Line))
-			FragmentShaderCode += "\n" + Line;
-		FragmentShaderStream.close();
+	/* Oldest unread item, or NULL when empty */
+	const T* peek ()
+	{
+		unsigned int h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return NULL;
+		return &ring[h % N];
 	}
 
-	GLint Result = GL_FALSE;
-	int InfoLogLength;
+	void pop ()
+	{
+		head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+};
 
-	// Compile Vertex Shader
-	cout << "Compiling shader : " <<  vertex_file_path << endl;
-	char const * VertexSourcePointer = VertexShaderCode.c_str();
-	glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
-	glCompileShader(VertexShaderID);
+/* GLFW callbacks run on the main thread and only record what happened; the
+   simulation thread applies the events in order at the start of each tick */
 
-	// Check Vertex Shader
-	glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> VertexShaderErrorMessage( max(InfoLogLength, int(1)) );
-	glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-	cout << VertexShaderErrorMessage.data() << endl;
+enum InputType { INPUT_KEY, INPUT_MOUSE_BUTTON, INPUT_CURSOR, INPUT_SCROLL };
 
-	// Compile Fragment Shader
-	cout << "Compiling shader : " << fragment_file_path << endl;
-	char const * FragmentSourcePointer = FragmentShaderCode.c_str();
-	glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
-	glCompileShader(FragmentShaderID);
+struct InputEvent {
+	int type;
+	int code; // key or mouse button
+	int action;
+	double x, y; // cursor position or scroll offset
+	long long time; // nanoseconds, steady clock
+};
 
-	// Check Fragment Shader
-	glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> FragmentShaderErrorMessage( max(InfoLogLength, int(1)) );
-	glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-	cout << FragmentShaderErrorMessage.data() << endl;
+SpscRing<InputEvent, 1024> input_queue;
+std::atomic<unsigned int> input_dropped(0);
 
-	// Link the program
-	cout << "Linking program" << endl;
-	GLuint ProgramID = glCreateProgram();
-	glAttachShader(ProgramID, VertexShaderID);
-	glAttachShader(ProgramID, FragmentShaderID);
-	glLinkProgram(ProgramID);
+void pushInput (int type, int code, int action, double x=0, double y=0)
+{
+	InputEvent event;
+	event.type = type;
+	event.code = code;
+	event.action = action;
+	event.x = x;
+	event.y = y;
+	event.time = nowNanos();
+	if (!input_queue.push(event))
+		input_dropped++;
+}
 
-	// Check the program
-	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
-	glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
-	glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
-	cout << ProgramErrorMessage.data() << endl;
 
-	glDeleteShader(VertexShaderID);
-	glDeleteShader(FragmentShaderID);
+/***********************
+ * Latency Measurement *
+ ***********************/
 
-	return ProgramID;
+/* With --latency every input event is followed through the tick that applied
+   it, the snapshot that tick published and the frame that drew it; the time
+   spent in each stage is printed on exit. With --late-latch the renderer turns
+   the orbit camera with the newest cursor position, not the one the snapshot
+   was simulated with */
+
+bool latency_mode = false;
+bool late_latch = false;
+std::atomic<double> latest_cursor_x(0);
+
+struct LatencyRecord {
+	unsigned long tick;
+	long long input; // event timestamp
+	long long applied; // start of the tick that applied it
+	long long published; // snapshot of that tick published
+};
+
+SpscRing<LatencyRecord, 4096> latency_records;
+
+// Inputs applied by the current tick, simulation thread only
+LatencyRecord tick_inputs[64];
+int tick_input_count = 0;
+
+enum LatencyStage { STAGE_QUEUE, STAGE_SIMULATE, STAGE_WAIT, STAGE_DRAW, STAGE_SWAP, STAGE_TOTAL, STAGE_COUNT };
+const char* latency_stage_names[STAGE_COUNT] = { "input queue", "simulation", "wait for render", "draw", "swap", "input to swap" };
+// Milliseconds, render thread only. A fixed ring, so a long session keeps
+// the newest LATENCY_SAMPLES events and the frame never allocates for them
+#define LATENCY_SAMPLES 65536
+float latency_samples[STAGE_COUNT][LATENCY_SAMPLES];
+unsigned long latency_sample_count = 0; // ever recorded
+
+void latencyInputApplied (long long input, long long applied)
+{
+	if (!latency_mode || tick_input_count == 64)
+		return;
+	tick_inputs[tick_input_count].input = input;
+	tick_inputs[tick_input_count].applied = applied;
+	tick_input_count++;
 }
 
-static void error_callback(int error, const char* description)
+void latencyTickPublished (unsigned long tick)
 {
-	cout << "Error: " << description << endl;
+	long long published = nowNanos();
+	for (int i=0; i<tick_input_count; i++) {
+		tick_inputs[i].tick = tick;
+		tick_inputs[i].published = published;
+		latency_records.push(tick_inputs[i]);
+	}
+	tick_input_count = 0;
 }
 
-void quit(GLFWwindow *window)
+/* Render thread, after the frame showing snapshot 'tick' has been swapped */
+void latencyFrame (unsigned long tick, long long draw_start, long long draw_end, long long swapped)
 {
-	glfwDestroyWindow(window);
-	glfwTerminate();
-	exit(EXIT_SUCCESS);
+	for (const LatencyRecord* r = latency_records.peek(); r && r->tick <= tick; r = latency_records.peek()) {
+		int i = latency_sample_count++ % LATENCY_SAMPLES;
+		latency_samples[STAGE_QUEUE][i] = (r->applied - r->input) / 1e6f;
+		latency_samples[STAGE_SIMULATE][i] = (r->published - r->applied) / 1e6f;
+		latency_samples[STAGE_WAIT][i] = (draw_start - r->published) / 1e6f;
+		latency_samples[STAGE_DRAW][i] = (draw_end - draw_start) / 1e6f;
+		latency_samples[STAGE_SWAP][i] = (swapped - draw_end) / 1e6f;
+		latency_samples[STAGE_TOTAL][i] = (swapped - r->input) / 1e6f;
+		latency_records.pop();
+	}
 }
 
-glm::vec3 getRGBfromHue (int hue)
+void latencyReport ()
 {
-	float intp;
-	float fracp = modff(hue/60.0, &intp);
-	float x = 1.0 - abs((float)((int)intp%2)+fracp-1.0);
+	int n = min(latency_sample_count, (unsigned long)LATENCY_SAMPLES);
+	cout << "Input latency over " << n << " events (ms)";
+	if (latency_sample_count > LATENCY_SAMPLES)
+		cout << ", the last of " << latency_sample_count;
+	cout << endl;
+	if (n == 0)
+		return;
+	cout << "stage              min    p50    p90    p99    max" << endl;
+	for (int s=0; s<STAGE_COUNT; s++) {
+		// Order does not matter to percentiles, sort the ring in place
+		float* samples = latency_samples[s];
+		sort(samples, samples + n);
+		cout << left << setw(16) << latency_stage_names[s] << right << fixed << setprecision(2)
+			 << setw(7) << samples[0] << setw(7) << samples[n/2] << setw(7) << samples[n*9/10]
+			 << setw(7) << samples[n*99/100] << setw(7) << samples[n-1] << endl;
+	}
+}
 
-	if (hue < 60)
-		return glm::vec3(1,x,0);
-	else if (hue < 120)
-		return glm::vec3(x,1,0);
-	else if (hue < 180)
-		return glm::vec3(0,1,x);
-	else if (hue < 240)
-		return glm::vec3(0,x,1);
-	else if (hue < 300)
-		return glm::vec3(x,0,1);
+
+/**************
+ * GPU Timers *
+ **************/
+
+/* GL_TIME_ELAPSED queries around each pass of draw(). A query is read back
+   GPU_TIMER_FRAMES frames after it was issued, when the GPU is long done with
+   it, so reading never stalls the pipeline; one that is still not available
+   is dropped. Results are averaged over the last GPU_TIMER_AVERAGE frames.
+   Render thread only */
+
+#define GPU_TIMER_FRAMES 4
+#define GPU_TIMER_AVERAGE 60
+
+enum GpuPass { PASS_TILES, PASS_HAZARDS, PASS_COINS, PASS_PLAYER, PASS_TEXT, PASS_COUNT };
+const char* gpu_pass_names[PASS_COUNT] = { "static tiles", "hazards", "coins", "player", "text" };
+
+struct GpuTimers {
+	bool supported;
+	GLuint queries[GPU_TIMER_FRAMES][PASS_COUNT];
+	bool issued[GPU_TIMER_FRAMES][PASS_COUNT];
+	int frame; // query slot of the frame being drawn
+	int active; // pass being timed, -1 for none
+
+	float history[PASS_COUNT][GPU_TIMER_AVERAGE]; // milliseconds
+	int history_count[PASS_COUNT];
+	int history_next[PASS_COUNT];
+	float history_sum[PASS_COUNT];
+} gpu_timers;
+
+std::atomic<bool> show_gpu_timings(false);
+
+void gpuTimersInit ()
+{
+	GLint bits = 0;
+	glGetQueryiv(GL_TIME_ELAPSED, GL_QUERY_COUNTER_BITS, &bits);
+	gpu_timers.supported = bits > 0;
+	gpu_timers.frame = 0;
+	gpu_timers.active = -1;
+	if (gpu_timers.supported)
+		glGenQueries(GPU_TIMER_FRAMES*PASS_COUNT, &gpu_timers.queries[0][0]);
 	else
-		return glm::vec3(1,0,x);
+		logPrint(LOG_WARN, "GL_TIME_ELAPSED queries not supported, no GPU timings");
 }
 
-/* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+void gpuTimerSample (int pass, float ms)
 {
-	struct VAO* vao = new struct VAO;
-	vao->PrimitiveMode = primitive_mode;
-	vao->NumVertices = numVertices;
-	vao->FillMode = fill_mode;
+	int next = gpu_timers.history_next[pass];
+	if (gpu_timers.history_count[pass] == GPU_TIMER_AVERAGE)
+		gpu_timers.history_sum[pass] -= gpu_timers.history[pass][next];
+	else
+		gpu_timers.history_count[pass]++;
+	gpu_timers.history[pass][next] = ms;
+	gpu_timers.history_sum[pass] += ms;
+	gpu_timers.history_next[pass] = (next + 1) % GPU_TIMER_AVERAGE;
+}
 
-	// Create Vertex Array Object
-	// Should be done after CreateWindow and before any other GL calls
-	glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-	glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-	glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
-
-	glBindVertexArray (vao->VertexArrayID); // Bind the VAO
-	glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
-	glVertexAttribPointer(
-						  0,                  // attribute 0. Vertices
-						  3,                  // size (x,y,z)
-						  GL_FLOAT,           // type
-						  GL_FALSE,           // normalized?
-						  0,                  // stride
-						  (void*)0            // array buffer offset
-						  );
-
-	glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
-	glVertexAttribPointer(
-						  1,                  // attribute 1. Color
-						  3,                  // size (r,g,b)
-						  GL_FLOAT,           // type
-						  GL_FALSE,           // normalized?
-						  0,                  // stride
-						  (void*)0            // array buffer offset
-						  );
-
-	return vao;
+/* Collect what the oldest frame in flight measured, its queries get reused now */
+void gpuTimersBeginFrame ()
+{
+	if (!gpu_timers.supported)
+		return;
+	int slot = gpu_timers.frame;
+	for (int pass=0; pass<PASS_COUNT; pass++) {
+		if (!gpu_timers.issued[slot][pass])
+			continue;
+		GLint available = 0;
+		glGetQueryObjectiv(gpu_timers.queries[slot][pass], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			GLuint64 elapsed;
+			glGetQueryObjectui64v(gpu_timers.queries[slot][pass], GL_QUERY_RESULT, &elapsed);
+			gpuTimerSample(pass, elapsed / 1e6f);
+		}
+		gpu_timers.issued[slot][pass] = false;
+	}
 }
 
-/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+void gpuPassEnd ()
 {
-	GLfloat* color_buffer_data = new GLfloat [3*numVertices];
-	for (int i=0; i<numVertices; i++) {
-		color_buffer_data [3*i] = red;
-		color_buffer_data [3*i + 1] = green;
-		color_buffer_data [3*i + 2] = blue;
+	if (gpu_timers.active < 0)
+		return;
+	glEndQuery(GL_TIME_ELAPSED);
+	gpu_timers.active = -1;
+}
+
+/* Ends the pass before, time elapsed queries can't nest */
+void gpuPassBegin (int pass)
+{
+	if (!gpu_timers.supported)
+		return;
+	gpuPassEnd();
+	glBeginQuery(GL_TIME_ELAPSED, gpu_timers.queries[gpu_timers.frame][pass]);
+	gpu_timers.issued[gpu_timers.frame][pass] = true;
+	gpu_timers.active = pass;
+}
+
+void gpuTimersEndFrame ()
+{
+	if (!gpu_timers.supported)
+		return;
+	gpuPassEnd();
+	gpu_timers.frame = (gpu_timers.frame + 1) % GPU_TIMER_FRAMES;
+}
+
+/* Average GPU time of a pass in milliseconds, 0 until measured */
+float gpuPassMillis (int pass)
+{
+	if (gpu_timers.history_count[pass] == 0)
+		return 0;
+	return gpu_timers.history_sum[pass] / gpu_timers.history_count[pass];
+}
+
+/********
+ * Text *
+ ********/
+
+/* All text is drawn from a signed distance field atlas of the printable
+   ASCII glyphs of arial.ttf, made with FreeType when the font asset loads.
+   A texel holds the distance to the glyph outline (0.5 on the outline), so
+   the one small atlas stays sharp at any size. drawText() only appends
+   quads to a batch, which textStream() copies into the stream buffer with
+   the rest of the frame's data; textFlush() then draws everything queued
+   in a frame, HUD included (hudQueue()), with one draw call */
+
+#define SDF_PIXEL_SIZE 32 // glyphs are rendered this many pixels high
+#define SDF_SPREAD 4 // distances further than this from the outline are clamped
+#define SDF_ATLAS_WIDTH 512
+#define SDF_ATLAS_HEIGHT 256
+#define FIRST_GLYPH 32 // space to '~'
+#define GLYPH_COUNT 95
+#define TEXT_MAX_GLYPHS 2048 // a frame's worth
+
+struct Glyph {
+	float u0, v0, u1, v1;
+	float left, top, width, height; // quad from the pen, y down, in SDF_PIXEL_SIZE pixels
+	float advance;
+};
+
+struct TextVertex {
+	GLfloat position[3];
+	GLfloat color[3];
+	GLfloat uv[2];
+};
+
+struct FontAtlas {
+	GLuint texture; // 0 until the font asset is loaded
+	Glyph glyphs[GLYPH_COUNT];
+} font_atlas;
+
+struct TextBatch {
+	GLuint vertex_array; // attributes point into the stream buffer, set by textFlush()
+	TextVertex vertices[TEXT_MAX_GLYPHS*6];
+	int vertex_count;
+	GLintptr offset; // where textStream() put this frame's vertices
+	int stream_count; // and how many
+	long dropped; // lines cut short at TEXT_MAX_GLYPHS
+} text_batch;
+
+/* Signed distance of every texel of the padded glyph to the outline of the
+   coverage bitmap, mapped to 0..255 with the outline at 128 */
+void glyphDistanceField (const FT_Bitmap& bitmap, unsigned char* field, int width, int height)
+{
+	auto inside = [&] (int x, int y) {
+		x -= SDF_SPREAD;
+		y -= SDF_SPREAD;
+		if (x < 0 || y < 0 || x >= (int)bitmap.width || y >= (int)bitmap.rows)
+			return false;
+		return bitmap.buffer[y*bitmap.pitch + x] >= 128;
+	};
+
+	for (int y=0; y<height; y++)
+		for (int x=0; x<width; x++) {
+			bool in = inside(x, y);
+			int nearest = SDF_SPREAD*SDF_SPREAD;
+			for (int dy=-SDF_SPREAD; dy<=SDF_SPREAD; dy++)
+				for (int dx=-SDF_SPREAD; dx<=SDF_SPREAD; dx++)
+					if (dx*dx + dy*dy < nearest && inside(x + dx, y + dy) != in)
+						nearest = dx*dx + dy*dy;
+			// The outline lies half way between a texel and its nearest opposite
+			float distance = sqrt((float)nearest) - 0.5;
+			float value = 0.5 + (in ? distance : -distance) / (2*SDF_SPREAD);
+			field[y*width + x] = (unsigned char) max(0.0f, min(255.0f, value*255 + 0.5f));
+		}
+}
+
+/* Render the glyphs of a font file, shelf pack their distance fields into
+   the atlas and make the vertex array text is drawn with. GL thread */
+bool createFontAtlas (const char* fontfile)
+{
+	PROFILE_ZONE("createFontAtlas");
+
+	// FreeType reads the face from memory so it can come from the pack
+	string font_data = readFile(fontfile);
+	FT_Library library;
+	FT_Face face;
+	if (FT_Init_FreeType(&library))
+		return false;
+	if (font_data.empty() || FT_New_Memory_Face(library, (const FT_Byte*) font_data.data(), font_data.size(), 0, &face)) {
+		FT_Done_FreeType(library);
+		return false;
+	}
+	FT_Set_Pixel_Sizes(face, 0, SDF_PIXEL_SIZE);
+
+	vector<unsigned char> atlas(SDF_ATLAS_WIDTH*SDF_ATLAS_HEIGHT, 0), field;
+	int shelf_x = 0, shelf_y = 0, shelf_height = 0;
+	for (int i=0; i<GLYPH_COUNT; i++) {
+		Glyph& glyph = font_atlas.glyphs[i];
+		memset(&glyph, 0, sizeof(glyph));
+		if (FT_Load_Char(face, FIRST_GLYPH + i, FT_LOAD_RENDER))
+			continue;
+		FT_GlyphSlot slot = face->glyph;
+		glyph.advance = slot->advance.x / 64.0;
+		if (slot->bitmap.width == 0 || slot->bitmap.rows == 0)
+			continue; // space
+
+		int width = slot->bitmap.width + 2*SDF_SPREAD, height = slot->bitmap.rows + 2*SDF_SPREAD;
+		if (shelf_x + width > SDF_ATLAS_WIDTH) {
+			shelf_x = 0;
+			shelf_y += shelf_height;
+			shelf_height = 0;
+		}
+		if (shelf_y + height > SDF_ATLAS_HEIGHT) {
+			logPrint(LOG_WARN, "Font atlas full at '%c'", FIRST_GLYPH + i);
+			break;
+		}
+		field.resize(width*height);
+		glyphDistanceField(slot->bitmap, &field[0], width, height);
+		for (int y=0; y<height; y++)
+			memcpy(&atlas[(shelf_y + y)*SDF_ATLAS_WIDTH + shelf_x], &field[y*width], width);
+
+		glyph.u0 = (float)shelf_x / SDF_ATLAS_WIDTH;
+		glyph.v0 = (float)shelf_y / SDF_ATLAS_HEIGHT;
+		glyph.u1 = (float)(shelf_x + width) / SDF_ATLAS_WIDTH;
+		glyph.v1 = (float)(shelf_y + height) / SDF_ATLAS_HEIGHT;
+		glyph.left = slot->bitmap_left - SDF_SPREAD;
+		glyph.top = -(slot->bitmap_top + SDF_SPREAD);
+		glyph.width = width;
+		glyph.height = height;
+		shelf_x += width;
+		shelf_height = max(shelf_height, height);
 	}
+	FT_Done_Face(face);
+	FT_Done_FreeType(library);
+
+	glGenTextures(1, &font_atlas.texture);
+	glBindTexture(GL_TEXTURE_2D, font_atlas.texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, SDF_ATLAS_WIDTH, SDF_ATLAS_HEIGHT, 0, GL_RED, GL_UNSIGNED_BYTE, &atlas[0]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	resourceAdd(RES_TEXTURE, font_atlas.texture, SDF_ATLAS_WIDTH*SDF_ATLAS_HEIGHT);
+
+	// The vertices themselves live in the stream buffer, a new place every frame
+	glGenVertexArrays(1, &text_batch.vertex_array);
+	glBindVertexArray(text_batch.vertex_array);
+	for (int i=0; i<3; i++)
+		glEnableVertexAttribArray(i);
+	glBindVertexArray(0);
+	bound_state.vertex_array = 0;
+	resourceAdd(RES_VERTEX_ARRAY, text_batch.vertex_array);
+	return true;
+}
 
-	return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+/* Lay out a line of text with its baseline starting at (x,y), in
+   framebuffer pixels from the top left corner, size pixels high. Writes at
+   most max_vertices and returns how many it wrote; full is set when that
+   was not enough */
+int layoutText (const char* text, float x, float y, float size, glm::vec3 color, TextVertex* vertices, int max_vertices, bool* full=NULL)
+{
+	float scale = size / SDF_PIXEL_SIZE;
+	int count = 0;
+	for (; *text; text++) {
+		int c = (unsigned char)*text - FIRST_GLYPH;
+		if (c < 0 || c >= GLYPH_COUNT)
+			c = '?' - FIRST_GLYPH;
+		const Glyph& glyph = font_atlas.glyphs[c];
+		if (glyph.width > 0) {
+			if (count + 6 > max_vertices) {
+				if (full)
+					*full = true;
+				break;
+			}
+			float x0 = x + glyph.left*scale, y0 = y + glyph.top*scale;
+			float x1 = x0 + glyph.width*scale, y1 = y0 + glyph.height*scale;
+			const TextVertex quad[6] = {
+				{ {x0,y0,0}, {color.x,color.y,color.z}, {glyph.u0,glyph.v0} },
+				{ {x0,y1,0}, {color.x,color.y,color.z}, {glyph.u0,glyph.v1} },
+				{ {x1,y1,0}, {color.x,color.y,color.z}, {glyph.u1,glyph.v1} },
+				{ {x0,y0,0}, {color.x,color.y,color.z}, {glyph.u0,glyph.v0} },
+				{ {x1,y1,0}, {color.x,color.y,color.z}, {glyph.u1,glyph.v1} },
+				{ {x1,y0,0}, {color.x,color.y,color.z}, {glyph.u1,glyph.v0} },
+			};
+			memcpy(&vertices[count], quad, sizeof(quad));
+			count += 6;
+		}
+		x += glyph.advance*scale;
+	}
+	return count;
 }
 
-struct VAO* create3DTexturedObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* texture_buffer_data, GLuint textureID, GLenum fill_mode=GL_FILL)
+/* Queue a line of text for textFlush(), see layoutText() */
+void drawText (const char* text, float x, float y, float size, glm::vec3 color)
 {
-	struct VAO* vao = new struct VAO;
-	vao->PrimitiveMode = primitive_mode;
-	vao->NumVertices = numVertices;
-	vao->FillMode = fill_mode;
-	vao->TextureID = textureID;
-
-	// Create Vertex Array Object
-	// Should be done after CreateWindow and before any other GL calls
-	glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-	glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-	glGenBuffers (1, &(vao->TextureBuffer));  // VBO - textures
-
-	glBindVertexArray (vao->VertexArrayID); // Bind the VAO
-	glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
-	glVertexAttribPointer(
-						  0,                  // attribute 0. Vertices
-						  3,                  // size (x,y,z)
-						  GL_FLOAT,           // type
-						  GL_FALSE,           // normalized?
-						  0,                  // stride
-						  (void*)0            // array buffer offset
-						  );
-
-	glBindBuffer (GL_ARRAY_BUFFER, vao->TextureBuffer); // Bind the VBO textures
-	glBufferData (GL_ARRAY_BUFFER, 2*numVertices*sizeof(GLfloat), texture_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
-	glVertexAttribPointer(
-						  2,                  // attribute 2. Textures
-						  2,                  // size (s,t)
-						  GL_FLOAT,           // type
-						  GL_FALSE,           // normalized?
-						  0,                  // stride
-						  (void*)0            // array buffer offset
-						  );
-
-	return vao;
-}
-
-/* Render the VBOs handled by VAO */
-void draw3DObject (struct VAO* vao)
+	int room = TEXT_MAX_GLYPHS*6 - text_batch.vertex_count;
+	bool full = false;
+	text_batch.vertex_count += layoutText(text, x, y, size, color, &text_batch.vertices[text_batch.vertex_count], room, &full);
+	if (full)
+		text_batch.dropped++;
+}
+
+/* Program, atlas and blending every text draw uses, until textEnd() */
+void textBegin ()
 {
-	// Change the Fill Mode for this object
-	glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+	ShaderVariant& shader = useShader(TEXT_SHADER);
+	glUniformMatrix4fv(shader.MatrixID, 1, GL_FALSE, &Matrices.screen[0][0]);
 
-	// Bind the VAO to use
-	glBindVertexArray (vao->VertexArrayID);
+	if (bound_state.fill_mode != GL_FILL) {
+		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+		bound_state.fill_mode = GL_FILL;
+	}
+	glBindTexture(GL_TEXTURE_2D, font_atlas.texture);
+	bound_state.texture = font_atlas.texture;
 
-	// Enable Vertex Attribute 0 - 3d Vertices
-	glEnableVertexAttribArray(0);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+}
 
-	// Enable Vertex Attribute 1 - Color
-	glEnableVertexAttribArray(1);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+void textEnd ()
+{
+	glDisable(GL_BLEND);
+	glEnable(GL_DEPTH_TEST);
+}
 
-	// Draw the geometry !
-	glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+/* Copy the text queued this frame into the stream buffer, before
+   streamEndWrites(). The batch is empty again for the next frame */
+void textStream ()
+{
+	text_batch.stream_count = 0;
+	if (text_batch.vertex_count == 0)
+		return;
+
+	size_t bytes = text_batch.vertex_count*sizeof(TextVertex);
+	TextVertex* vertices = (TextVertex*) streamAlloc(bytes, text_batch.offset);
+	if (vertices) {
+		memcpy(vertices, text_batch.vertices, bytes);
+		text_batch.stream_count = text_batch.vertex_count;
+#ifdef GL_CALL_STATS
+		gl_stats.frame.bytes += bytes;
+#endif
+	}
+	text_batch.vertex_count = 0;
 }
 
-void draw3DTexturedObject (struct VAO* vao)
+/* Draw the text streamed this frame over the scene, in one draw call. The
+   stream buffer must be bound (see streamEndWrites()) */
+void textFlush ()
 {
-	// Change the Fill Mode for this object
-	glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+	if (text_batch.stream_count == 0)
+		return;
+
+	glBindVertexArray(text_batch.vertex_array);
+	bound_state.vertex_array = text_batch.vertex_array;
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(TextVertex), (void*)(text_batch.offset + offsetof(TextVertex, position)));
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(TextVertex), (void*)(text_batch.offset + offsetof(TextVertex, color)));
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(TextVertex), (void*)(text_batch.offset + offsetof(TextVertex, uv)));
+	glDrawArrays(GL_TRIANGLES, 0, text_batch.stream_count);
+}
 
-	// Bind the VAO to use
-	glBindVertexArray (vao->VertexArrayID);
+/*******
+ * HUD *
+ *******/
 
-	// Enable Vertex Attribute 0 - 3d Vertices
-	glEnableVertexAttribArray(0);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+/* Score, lives, health and level in the top left corner. Each element keeps
+   its laid out glyphs, done again only when its value changes, so a frame
+   where nothing changed just copies the cached runs into the text batch
+   and they go out in the frame's one text draw */
 
-	// Bind Textures using texture units
-	glBindTexture(GL_TEXTURE_2D, vao->TextureID);
+#define HUD_ELEMENT_GLYPHS 24
 
-	// Enable Vertex Attribute 2 - Texture
-	glEnableVertexAttribArray(2);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->TextureBuffer);
+enum HudElement { HUD_LEVEL, HUD_SCORE, HUD_LIFE, HUD_HEALTH, HUD_ELEMENT_COUNT };
 
-	// Draw the geometry !
-	glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+struct HudText {
+	const char* format;
+	float x, y, size;
+	int warn_at; // drawn red at or below this value
+	int value;
+	bool built; // value is laid out in run
+	TextVertex run[HUD_ELEMENT_GLYPHS*6];
+	int vertex_count; // of run
+};
 
-	// Unbind Textures to be safe
-	glBindTexture(GL_TEXTURE_2D, 0);
+struct Hud {
+	HudText elements[HUD_ELEMENT_COUNT];
+	long rebuilds;
+} hud = { {
+	{ "Level %d", 16, 36, 28, INT_MIN },
+	{ "Score %d", 16, 68, 28, INT_MIN },
+	{ "Life %d", 16, 100, 28, 1 },
+	{ "Health %d", 16, 132, 28, 40 },
+} };
+
+void hudSet (int element, int value)
+{
+	HudText& text = hud.elements[element];
+	if (text.built && text.value == value)
+		return;
+	text.value = value;
+	text.built = false;
 }
 
-/* Create an OpenGL Texture from an image */
-GLuint createTexture (const char* filename)
+/* Lay out the elements that changed and queue them all for textFlush() */
+void hudQueue ()
 {
-	GLuint TextureID;
-	// Generate Texture Buffer
-	glGenTextures(1, &TextureID);
-	// All upcoming GL_TEXTURE_2D operations now have effect on our texture buffer
-	glBindTexture(GL_TEXTURE_2D, TextureID);
-	// Set our texture parameters
-	// Set texture wrapping to GL_REPEAT
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	// Set texture filtering (interpolation)
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	for (int i=0; i<HUD_ELEMENT_COUNT; i++) {
+		HudText& text = hud.elements[i];
+		if (!text.built) {
+			char line[64];
+			snprintf(line, sizeof(line), text.format, text.value);
+			glm::vec3 color = text.value <= text.warn_at ? glm::vec3(1,0.3,0.3) : glm::vec3(1,1,1);
+			text.vertex_count = layoutText(line, text.x, text.y, text.size, color, text.run, HUD_ELEMENT_GLYPHS*6);
+			text.built = true;
+			hud.rebuilds++;
+		}
+
+		int count = min(text.vertex_count, TEXT_MAX_GLYPHS*6 - text_batch.vertex_count);
+		memcpy(&text_batch.vertices[text_batch.vertex_count], text.run, count*sizeof(TextVertex));
+		text_batch.vertex_count += count;
+	}
+}
 
-	// Load image and create OpenGL texture
-	int twidth, theight;
-	unsigned char* image = SOIL_load_image(filename, &twidth, &theight, 0, SOIL_LOAD_RGB);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, twidth, theight, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-	glGenerateMipmap(GL_TEXTURE_2D); // Generate MipMaps to use
-	SOIL_free_image_data(image); // Free the data read from file after creating opengl texture
-	glBindTexture(GL_TEXTURE_2D, 0); // Unbind texture when done, so we won't accidentily mess it up
+void drawGpuTimings ()
+{
+	float total = 0;
+	float y = 180;
 
-	return TextureID;
+	for (int pass=0; pass<PASS_COUNT; pass++, y += 22) {
+		drawText(gpu_pass_names[pass], 16, y, 20, glm::vec3(1,1,0));
+		drawText(frameFormat("%6.3f ms", gpuPassMillis(pass)), 140, y, 20, glm::vec3(1,1,0));
+		total += gpuPassMillis(pass);
+	}
+	drawText("gpu total", 16, y, 20, glm::vec3(1,1,1));
+	drawText(frameFormat("%6.3f ms", total), 140, y, 20, glm::vec3(1,1,1));
 }
 
 
@@ -358,7 +3639,7 @@ int t_count;
 int jump =0;
 float v,rotateangle,u_x,u_y,u_z,k_x,k_y,k_z,restart=0,vel =1;
 
-int get;
+int got_key;
 
 
 
@@ -368,9 +3649,8 @@ float rectangle_rot_dir = -1;
 bool triangle_rot_status = true;
 bool rectangle_rot_status = true;
 
-/* Executed when a regular key is pressed/released/held-down */
-/* Prefered for Keyboard events */
-void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+/* Applied by the simulation thread for each queued key event */
+void applyKey (int key, int action)
 {
 	// Function is called first on GLFW_PRESS.
 
@@ -403,8 +3683,6 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 	}
 	else if (action == GLFW_PRESS) {
 		switch (key) {
-			case GLFW_KEY_ESCAPE:
-				quit(window);
 			case GLFW_KEY_UP:
 				movement = 1;
 				break;
@@ -462,6 +3740,22 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 	}
 }
 
+/* Executed when a regular key is pressed/released/held-down */
+/* Prefered for Keyboard events */
+void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+	if (action == GLFW_PRESS && key == GLFW_KEY_ESCAPE)
+		quit(window);
+	else if (action == GLFW_PRESS && key == GLFW_KEY_G)
+		show_gpu_timings = !show_gpu_timings;
+#ifdef GL_CALL_STATS
+	else if (action == GLFW_PRESS && key == GLFW_KEY_F3)
+		dump_gl_stats = true;
+#endif
+	else if (action != GLFW_REPEAT)
+		pushInput(INPUT_KEY, key, action);
+}
+
 /* Executed for character input (like in text boxes) */
 void keyboardChar (GLFWwindow* window, unsigned int key)
 {
@@ -476,10 +3770,10 @@ void keyboardChar (GLFWwindow* window, unsigned int key)
 }
 
 bool rmos = false;
-bool test = false;
-
-/* Executed when a mouse button is pressed/released */
-void mouseButton (GLFWwindow* window, int button, int action, int mods)
+float drag_x; // cursor x the camera drag was last applied at
+
+/* Applied by the simulation thread for each queued mouse button event */
+void applyMouseButton (int button, int action)
 {
 	switch (button) {
 		case GLFW_MOUSE_BUTTON_LEFT:
@@ -493,7 +3787,7 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods)
             else if(action == GLFW_PRESS) 
             {
             	rmos = true;
-            	test = true;
+            	drag_x = mos_x;
             }
             break;
 			
@@ -502,9 +3796,25 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods)
 	}
 }
 
+/* Executed when a mouse button is pressed/released */
+void mouseButton (GLFWwindow* window, int button, int action, int mods)
+{
+	pushInput(INPUT_MOUSE_BUTTON, button, action);
+}
+
+/* Executed when the mouse moves */
+void cursorPosition (GLFWwindow* window, double x, double y)
+{
+	latest_cursor_x = x;
+	pushInput(INPUT_CURSOR, 0, 0, x, y);
+}
+
+std::atomic<int> framebuffer_width(0), framebuffer_height(0);
+std::atomic<bool> framebuffer_resized(false);
 
 /* Executed when window is resized to 'width' and 'height' */
-/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
+/* The GL context belongs to the render thread, which applies the new size
+   with resizeViewport() before its next frame */
 void reshapeWindow (GLFWwindow* window, int width, int height)
 {
 	int fbwidth=width, fbheight=height;
@@ -512,6 +3822,16 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
 	 is different from WindowSize */
 	glfwGetFramebufferSize(window, &fbwidth, &fbheight);
 
+	framebuffer_width = fbwidth;
+	framebuffer_height = fbheight;
+	framebuffer_resized = true;
+}
+
+/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
+void resizeViewport ()
+{
+	int fbwidth = framebuffer_width, fbheight = framebuffer_height;
+
 	GLfloat fov = 45.0f;
 
 	// sets the viewport of openGL renderer
@@ -524,12 +3844,14 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
 	// Store the projection matrix in a variable for future use
 	// Perspective projection for 3D views
 	Matrices.projection = glm::perspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 1.0f, 500.0f);
+	Matrices.screen = glm::ortho (0.0f, (GLfloat) fbwidth, (GLfloat) fbheight, 0.0f, -1.0f, 1.0f);
 
 	// Ortho projection for 2D views
 	//Matrices.projection = glm::ortho(-150.0f, 150.0f, -150.0f, 150.0f, -500.0f, 500.0f);
 }
 
-VAO *triangle, *rectangle , *cube , *box , *sphere, *plate, *plate_holes , *pyramid, *u, *k, *coin;
+MeshHandle triangle, rectangle , cube , box , sphere, plate, plate_holes , pyramid, u, k, coin;
+int tile_texture = -1; // array texture of the sand tiles
 
 
 void createcoin(int numberOfSides,int x,int y,int z,float radius){
@@ -570,11 +3892,12 @@ void createcoin(int numberOfSides,int x,int y,int z,float radius){
 	coin = create3DObject(GL_TRIANGLE_FAN, numberOfVertices, vertex_buffer_data, color_buffer_data, GL_FILL);
 
 }
-VAO* createCube (float l, float w, float h, float color[2][3])
+/* The 36 vertices of a box of l x w around the z axis, from z=0 to z=h */
+void cubeVertices (float l, float w, float h, GLfloat* vertex_buffer_data)
 {
 	float x=l/2, y=w/2, z=h;
     // GL3 accepts only Triangles. Quads are not supported
-    GLfloat vertex_buffer_data [] = {
+    const GLfloat cube_vertex_data [] = {
         -x,-y,0, // triangle 1 : begin
         -x,-y, z,
         -x, y, z,
@@ -617,6 +3940,14 @@ VAO* createCube (float l, float w, float h, float color[2][3])
         -x, y,0,
         -x, y, z,
     };
+	memcpy(vertex_buffer_data, cube_vertex_data, sizeof(cube_vertex_data));
+}
+
+MeshHandle createCube (float l, float w, float h, float color[2][3])
+{
+	PROFILE_ZONE("createCube");
+    GLfloat vertex_buffer_data [108];
+    cubeVertices(l, w, h, vertex_buffer_data);
     
     GLfloat color_buffer_data [] = {
         
@@ -673,7 +4004,34 @@ VAO* createCube (float l, float w, float h, float color[2][3])
     // create3DObject creates and returns a handle to a VAO that can be used later
     return create3DObject(GL_TRIANGLES, 36, vertex_buffer_data, color_buffer_data, GL_FILL);
 }
-VAO* createCubeLift ()
+/* A cube textured with one layer of an array texture, each face mapped
+   once over the whole image */
+MeshHandle createTexturedCube (float l, float w, float h, int layer, int texture)
+{
+	PROFILE_ZONE("createCube");
+	GLfloat vertex_buffer_data [108];
+	cubeVertices(l, w, h, vertex_buffer_data);
+	const float size[3] = { l, w, h }, low[3] = { -l/2, -w/2, 0 };
+
+	GLfloat texture_buffer_data [108];
+	for (int t=0; t<12; t++) {
+		// Axis the triangle is flat on, the other two span the image
+		const GLfloat* v = vertex_buffer_data + 9*t;
+		int flat = 0;
+		while (flat < 2 && !(v[flat] == v[3 + flat] && v[flat] == v[6 + flat]))
+			flat++;
+		int s_axis = flat == 0 ? 1 : 0, t_axis = flat == 2 ? 1 : 2;
+		for (int i=0; i<3; i++) {
+			GLfloat* uv = texture_buffer_data + 9*t + 3*i;
+			uv[0] = (v[3*i + s_axis] - low[s_axis]) / size[s_axis];
+			uv[1] = 1 - (v[3*i + t_axis] - low[t_axis]) / size[t_axis];
+			uv[2] = layer;
+		}
+	}
+
+	return create3DTextureArrayObject(GL_TRIANGLES, 36, vertex_buffer_data, texture_buffer_data, texture, GL_FILL);
+}
+MeshHandle createCubeLift ()
 {
 	static const GLfloat vertex_buffer_data [] = {
 		-5,-5,0, // vertex 1
@@ -731,7 +4089,7 @@ void createTriangle ()
 }
 
 // Creates the rectangle object used in this sample code
-void createRectangle (GLuint textureID)
+void createRectangle (int texture)
 {
 	// GL3 accepts only Triangles. Quads are not supported
 	static const GLfloat vertex_buffer_data [] = {
@@ -766,7 +4124,7 @@ void createRectangle (GLuint textureID)
 	};
 
 	// create3DTexturedObject creates and returns a handle to a VAO that can be used later
-	rectangle = create3DTexturedObject(GL_TRIANGLES, 6, vertex_buffer_data, texture_buffer_data, textureID, GL_FILL);
+	rectangle = create3DTexturedObject(GL_TRIANGLES, 6, vertex_buffer_data, texture_buffer_data, texture, GL_FILL);
 }
 
 void createplate ()
@@ -887,168 +4245,99 @@ float camera_rotation_angle = 90;
 float rectangle_rotation = 0;
 float triangle_rotation = 0;
 
-float angle,v_j,z_p,z_c,rotatangle = 0;
+float angle,v_j,z_c,rotatangle = 0;
 
 int p;
 
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 {
-	z_c-= 2*yoffset;
-	//cout << "here" << yoffset << w << endl;
+	pushInput(INPUT_SCROLL, 0, 0, xoffset, yoffset);
 }
-/* Render the scene with openGL */
-/* Edit this function according to your assignment */
-void draw ()
-{
-	// clear the color and depth in the frame buffer
-	glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	// use the loaded shader program
-	// Don't change unless you know what you are doing
-	glUseProgram (programID);
-	// Eye - Location of camera. Don't change unless you are sure!!
-
-	static float prev_x;
-	
-		if(test)
-		{
-			prev_x = mos_x; 
-			test = false;
-		}
-		if(rmos)
-		{
-			angle+= (mos_x - prev_x)*(M_PI)/300;
-			prev_x = mos_x;
-		}
+/* Releases that arrived in the same tick as their press, applied next tick so
+   that a quick tap still moves the player for one tick. Pressing the same
+   key again in that tick drops the release, the key is held after all */
+InputEvent deferred_input[16];
+int deferred_count = 0;
 
-	if(view!=1){
-		t_count = 0;
+void applyInput (const InputEvent& event)
+{
+	switch (event.type) {
+		case INPUT_KEY:
+			applyKey(event.code, event.action);
+			break;
+		case INPUT_MOUSE_BUTTON:
+			applyMouseButton(event.code, event.action);
+			break;
+		case INPUT_CURSOR:
+			// Camera drag is applied per event, so no motion is lost between ticks
+			if(rmos)
+				angle+= (event.x - drag_x)*(M_PI)/300;
+			drag_x = event.x;
+			mos_x = event.x;
+			mos_y = event.y;
+			break;
+		case INPUT_SCROLL:
+			z_c-= 2*event.y;
+			break;
 	}
+}
 
-	switch (view) {
-			case 1:
-				Matrices.view = glm::lookAt(glm::vec3(0.0000001,0,300), glm::vec3(0,0,0), glm::vec3(0,0,1));
-				break;
-			case 2:
-				Matrices.view = glm::lookAt(glm::vec3(180*1.414*cos(angle),-180*1.414*sin(angle),z_c), glm::vec3(0,0,0), glm::vec3(0,0,1)); 
-				break;
-			case 3:
-				Matrices.view = glm::lookAt(glm::vec3(200,0,200), glm::vec3(0,0,0), glm::vec3(0,0,1));
-				break;
-			case 4:
-				Matrices.view = glm::lookAt(glm::vec3(x_b+7*cos(rotateangle),y_b+7*sin(rotateangle),z_b+10), glm::vec3(x_b+cos(rotateangle)*40,y_b+sin(rotateangle)*40,z_b), glm::vec3(0,0,1));
-				break;
-
-			case 5:
-				Matrices.view = glm::lookAt(glm::vec3(x_b-20*cos(rotateangle),y_b-20*sin(rotateangle),z_b+30), glm::vec3(x_b+cos(rotateangle)*40,y_b+sin(rotateangle)*40,z_b+5), glm::vec3(0,0,1));
-				break;
-			
-			}
-
-	//  Don't change unless you are sure!!
-	glm::mat4 VP = Matrices.projection * Matrices.view;
-
-	// Send our transformation to the currently bound shader, in the "MVP" uniform
-	// For each model you render, since the MVP will be different (at least the M part)
-	//  Don't change unless you are sure!!
-	glm::mat4 MVP;	// MVP = Projection * View * Model
-
-	// Load identity to model matrix
-	for( int i=0;i < arr_block1.size();i++){
-		Matrices.model = glm::mat4(1.0f);
-		glm::mat4 translateRectangle = glm::translate (block1[i]);
-		Matrices.model *=  (translateRectangle );
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		draw3DObject(arr_block1[i]);
-	}	
-
+/* Apply every event that happened before 'tick_time' */
+void processInput (long long tick_time)
+{
+	int pressed[16], pressed_count = 0;
+	long long applied = nowNanos();
 
-	for( int i=0;i < arr_block3.size();i++){
-		Matrices.model = glm::mat4(1.0f);
-		glm::mat4 translateRectangle = glm::translate (block3[i]);
-		Matrices.model *=  (translateRectangle );
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		draw3DObject(arr_block3[i]);
+	for (int i=0; i<deferred_count; i++) {
+		applyInput(deferred_input[i]);
+		latencyInputApplied(deferred_input[i].time, applied);
 	}
-	for( int i=0;i < block4.size();i++){
-		Matrices.model = glm::mat4(1.0f);
-		glm::mat4 translateRectangle2 = glm::translate (block4[i]);
-		Matrices.model *=  (translateRectangle2 );
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		draw3DObject(plate);
-
-		Matrices.model = glm::mat4(1.0f);
-		glm::mat4 translateplate1 = glm::translate(glm::vec3(2,2,0.1));
-		Matrices.model *=  (translateRectangle2 * translateplate1);
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		draw3DObject(plate_holes);
-
-		Matrices.model = glm::mat4(1.0f);
-		glm::mat4 translateplate2 = glm::translate(glm::vec3(2,-2,0.1));
-		Matrices.model *=  (translateRectangle2 * translateplate2);
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		draw3DObject(plate_holes);
-
-		Matrices.model = glm::mat4(1.0f);
-		glm::mat4 translateplate3 = glm::translate(glm::vec3(-2,2,0.1));
-		Matrices.model *=  (translateRectangle2 * translateplate3);
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		draw3DObject(plate_holes);
-
-		Matrices.model = glm::mat4(1.0f);
-		glm::mat4 translateplate4 = glm::translate(glm::vec3(-2,-2,0.1));
-		Matrices.model *=  (translateRectangle2 * translateplate4);
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		draw3DObject(plate_holes);
-
-
-		if( sqrt(pow((x_b - block4[i][0]),2)+ pow((y_b - block4[i][1]),2)) < 30 ){
-			z_p = 0.01;
+	deferred_count = 0;
+
+	for (const InputEvent* event = input_queue.peek(); event && event->time <= tick_time; event = input_queue.peek()) {
+		bool defer = false;
+		if (event->type == INPUT_KEY || event->type == INPUT_MOUSE_BUTTON) {
+			int code = event->type == INPUT_KEY ? event->code : -1 - event->code;
+			if (event->action == GLFW_PRESS && pressed_count < 16)
+				pressed[pressed_count++] = code;
+			if (event->action == GLFW_PRESS)
+				for (int i=0; i<deferred_count; i++)
+					if (deferred_input[i].type == event->type && deferred_input[i].code == event->code) {
+						latencyInputApplied(deferred_input[i].time, applied);
+						deferred_input[i--] = deferred_input[--deferred_count];
+					}
+			for (int i=0; event->action == GLFW_RELEASE && i<pressed_count; i++)
+				defer = defer || pressed[i] == code;
 		}
-		else{
 
-			z_p = -9;
+		if (defer && deferred_count < 16)
+			deferred_input[deferred_count++] = *event;
+		else {
+			applyInput(*event);
+			latencyInputApplied(event->time, applied);
 		}
+		input_queue.pop();
+	}
+}
 
-		Matrices.model = glm::mat4(1.0f);
-		glm::mat4 translatepl1 = glm::translate(glm::vec3(2,2,z_p));
-		Matrices.model *=  (translateRectangle2 * translatepl1);
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		draw3DObject(pyramid);
-
-		Matrices.model = glm::mat4(1.0f);
-		glm::mat4 translatepl2 = glm::translate(glm::vec3(2,-2,z_p));
-		Matrices.model *=  (translateRectangle2 * translatepl2);
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		draw3DObject(pyramid);
-
-		Matrices.model = glm::mat4(1.0f);
-		glm::mat4 translatepl3 = glm::translate(glm::vec3(-2,2,z_p));
-		Matrices.model *=  (translateRectangle2 * translatepl3);
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		draw3DObject(pyramid);
-
-		Matrices.model = glm::mat4(1.0f);
-		glm::mat4 translatepl4 = glm::translate(glm::vec3(-2,-2,z_p));
-		Matrices.model *=  (translateRectangle2 * translatepl4);
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		draw3DObject(pyramid);
+/* Results of the per block queries, one entry per block. char and not bool,
+   so that jobs writing neighbouring entries never share a word */
+ArenaArray<char> wall_hit, hole_hit, spike_hit, coin_hit;
+ArenaArray<float> spike_height;
 
+JobGraph sim_graph, draw_graph;
 
+/* Key and lift triggers and the player integration step. There
+   is a single body to integrate, so this one stays a single job */
+void jobIntegrate (void* data, int begin, int end)
+{
+	PROFILE_ZONE("integrate");
+	if(view!=1){
+		t_count = 0;
 	}
 
-	if(sqrt(pow((x_b - u_x),2)+ pow((y_b - u_y),2)) < 3 & get == 1){
+	if(sqrt(pow((x_b - u_x),2)+ pow((y_b - u_y),2)) < 3 & got_key == 1){
 
 		p = 5;
 	}
@@ -1056,7 +4345,7 @@ void draw ()
 	if(p==5){
 
 		u_z += 0.2;
-		z_b += 0.2; 
+		z_b += 0.2;
 	}
 
 	if( u_z > 100){
@@ -1064,40 +4353,15 @@ void draw ()
 		p = 10;
 	}
 
-	if(level!=0){
-		Matrices.model = glm::mat4(1.0f);
-		glm::mat4 translatelift = glm::translate(glm::vec3(u_x,u_y,u_z));
-		Matrices.model *=  (translatelift );
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		draw3DObject(u);
-    }
-
 	if (sqrt(pow((x_b - k_x),2)+ pow((y_b - k_y),2)) < 8 ){
 
-		get = 1;
-	}
-
-
-
-	if(get == 0 && level !=0){
-
-
-		Matrices.model = glm::mat4(1.0f);
-		glm::mat4 translatekey = glm::translate(glm::vec3(k_x,k_y,k_z));
-		Matrices.model *=  (translatekey );
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		draw3DObject(k);
+		got_key = 1;
 	}
 
-	
 	if(man_ang != 0){
 
-		rotateangle += (man_ang/M_PI)/10; 
+		rotateangle += (man_ang/M_PI)/10;
 	}
-	
-
 
 	if(p!=2 && p!=3 && p!=5){
 		x_b =  x_b + cos(rotateangle)*movement*vel;
@@ -1105,136 +4369,732 @@ void draw ()
 
 	}
 
+	rotatangle += 0.1;
+}
+
+void jobWallQuery (void* data, int begin, int end)
+{
+	PROFILE_ZONE("wall collisions");
+	for ( int i=begin;i< end;i++)
+		wall_hit[i] = abs(x_b-block3[i][0])<10 && abs(y_b-block3[i][1])<10;
+}
+
+void jobHoleQuery (void* data, int begin, int end)
+{
+	PROFILE_ZONE("hole collisions");
+	for ( int i=begin;i< end;i++)
+		hole_hit[i] = abs(x_b-block2[i][0])<9 && abs(y_b-block2[i][1])<7 && z_b <=20;
+}
 
+/* Apply wall and hole hits in block order. Holes are 10 apart, so once the
+   player snaps into the first hole hit no other hole can match */
+void jobResolveMovement (void* data, int begin, int end)
+{
+	PROFILE_ZONE("resolve movement");
 	for ( int i=0;i< block3.size();i++){
 
-		if(abs(x_b-block3[i][0])<10 && abs(y_b-block3[i][1])<10 && p!=2 )
+		if( wall_hit[i] && p!=2 )
 		{
-			
 			p = 1;
-			
+			break;
 		}
 	}
 
 	for ( int i=0;i< block2.size();i++){
 
-		if(abs(x_b-block2[i][0])<9 && abs(y_b-block2[i][1])<7 && z_b <=20 )
+		if( hole_hit[i] )
 		{
-			
 			p = 2;
 			x_b = block2[i][0];
 			y_b = block2[i][1];
-			
+			break;
 		}
 	}
+}
+
+void jobSpikeQuery (void* data, int begin, int end)
+{
+	PROFILE_ZONE("spike collisions");
+	for ( int i=begin;i< end;i++){
+		spike_hit[i] = abs(x_b-block4[i][0])<8 && abs(y_b-block4[i][1])<8 && z_b <=26;
+
+		// Spikes come out of the plate once the player is close
+		if( sqrt(pow((x_b - block4[i][0]),2)+ pow((y_b - block4[i][1]),2)) < 30 )
+			spike_height[i] = 0.01;
+		else
+			spike_height[i] = -9;
+	}
+}
+
+void jobCoinQuery (void* data, int begin, int end)
+{
+	PROFILE_ZONE("coin collisions");
+	for ( int i=begin;i< end;i++)
+		coin_hit[i] = sqrt(pow((x_b - block5[i][0]),2)+ pow((y_b - block5[i][1]),2)) < 7.5 && abs(z_b - block5[i][2]) < 15;
+}
+
+void jobResolve (void* data, int begin, int end)
+{
+	PROFILE_ZONE("resolve collisions");
 	for ( int i=0;i< block4.size();i++){
 
-		if(abs(x_b-block4[i][0])<8 && abs(y_b-block4[i][1])<8 && z_b <=26 )
+		if( spike_hit[i] )
 		{
-			
 			p = 3;
-
-			
-			
+			break;
 		}
 	}
-	rotatangle += 0.1;
+
 	for ( int i=0;i< block5.size();i++){
 
-		if( sqrt(pow((x_b - block5[i][0]),2)+ pow((y_b - block5[i][1]),2)) < 7.5   &&  abs(z_b - block5[i][2]) < 15)
-		{
-			
-			block5[i][2] = 1000;
+		if( coin_hit[i] )
+		{
+			block5[i][2] = 1000;
+
+			score += 10;
+
+			logPrint(LOG_INFO, "Score = %d", score);
+		}
+	}
+
+	if(p==1){
+
+		x_b =  x_b - cos(rotateangle)*movement*vel;
+		y_b =  y_b - sin(rotateangle)*movement*vel;
+		z_b = 20;
+		p = 0;
+	}
+	if(p==2 ){
+
+		z_b += -2;
+
+	}
+
+	if(z_b < -300 ) {
+
+		x_b = 80;
+		y_b = -80;
+		z_b = 20;
+		rotateangle = M_PI/2;
+		p = 0;
+		life--;
+		logPrint(LOG_INFO, "lost life ; life = %d", life);
+	}
+
+	if(p == 3 ) {
+
+		x_b = 80;
+		y_b = -80;
+		z_b = 20;
+		rotateangle = M_PI/2;
+		p = 0;
+		health += -20;
+
+		if ( health <= 0){
+			health = 100;
+			life--;
+			logPrint(LOG_INFO, "lost life ; life = %d", life);
+		}
+
+		logPrint(LOG_INFO, "health = %d", health);
+
+	}
+	if (jump == 1 & p!= 2 & p!=5){
+
+		v -= 0.1;
+		z_b += v;
+		if(z_b <= 20){
+			z_b = 20;
+			jump = 0;
+		}
+
+
+	}
+}
+
+/* Advance the game by one frame */
+void simulate ()
+{
+	PROFILE_ZONE("simulate");
+	jobGraphReset(sim_graph);
+
+	int integrate = jobAdd(sim_graph, jobIntegrate, NULL);
+	int queries[2];
+	queries[0] = jobParallelFor(sim_graph, jobWallQuery, NULL, block3.size(), 64, &integrate, 1);
+	queries[1] = jobParallelFor(sim_graph, jobHoleQuery, NULL, block2.size(), 64, &integrate, 1);
+
+	// Spikes and coins test the position after the wall and hole response
+	int movement_done = jobAdd(sim_graph, jobResolveMovement, NULL);
+	jobDepend(sim_graph, movement_done, queries[0]);
+	jobDepend(sim_graph, movement_done, queries[1]);
+	queries[0] = jobParallelFor(sim_graph, jobSpikeQuery, NULL, block4.size(), 64, &movement_done, 1);
+	queries[1] = jobParallelFor(sim_graph, jobCoinQuery, NULL, block5.size(), 64, &movement_done, 1);
+
+	int resolve = jobAdd(sim_graph, jobResolve, NULL);
+	jobDepend(sim_graph, resolve, queries[0]);
+	jobDepend(sim_graph, resolve, queries[1]);
+
+	jobRun(sim_graph);
+}
+
+// Layers of the array texture sand ('t') tiles are drawn with, they
+// alternate in a checkerboard
+#define TILE_TEXTURE_LAYERS 2
+const char* tile_texture_files[TILE_TEXTURE_LAYERS] = { "beach.png", "beach2.png" };
+
+
+/*********************
+ * Resource Manifest *
+ *********************/
+
+/* Assets that are not part of every frame are declared here and made the
+   first time something asks for them with assetRequire(), so startup only
+   pays for what the running level draws. GL thread only. assetReport()
+   lists what is loaded and what never was */
+
+enum AssetId { ASSET_TRIANGLE, ASSET_RECTANGLE, ASSET_BEACH_TEXTURE, ASSET_TILE_TEXTURE, ASSET_PLATES, ASSET_COIN, ASSET_FONT, ASSET_COUNT };
+
+struct Asset {
+	const char* name;
+	void (*create) ();
+	bool loaded;
+	int requests;
+	long long load_nanos; // time spent making it
+	long long loaded_at; // since the manifest was started
+};
+
+int beach_texture = -1;
+long long asset_epoch;
+
+void assetRequire (int id);
+
+void assetTriangle ()
+{
+	createTriangle ();
+}
+
+void assetRectangle ()
+{
+	assetRequire(ASSET_BEACH_TEXTURE);
+	createRectangle (beach_texture);
+}
+
+void assetBeachTexture ()
+{
+	submitShaderVariant(TEXTURE_SHADER);
+	beach_texture = createTexture("beach2.png");
+}
+
+void assetTileTexture ()
+{
+	submitShaderVariant(TILE_SHADER);
+	tile_texture = createTextureArray(tile_texture_files, TILE_TEXTURE_LAYERS);
+}
+
+void assetPlates ()
+{
+	createplate();
+	createplate_holes();
+	createpyramid();
+}
+
+void assetCoin ()
+{
+	createcoin(1000,0,0,0,2.5);
+}
+
+void assetFont ()
+{
+	if (!shader_variants[TEXT_SHADER].submitted)
+		submitShaderVariant(TEXT_SHADER);
+
+	const char* fontfile = "arial.ttf";
+	if (!createFontAtlas(fontfile))
+	{
+		logPrint(LOG_ERROR, "Could not load font `%s'", fontfile);
+		glfwTerminate();
+		exit(EXIT_FAILURE);
+	}
+}
+
+Asset assets[ASSET_COUNT] = {
+	{ "triangle", assetTriangle },
+	{ "rectangle", assetRectangle },
+	{ "beach2.png", assetBeachTexture },
+	{ "tile textures", assetTileTexture },
+	{ "spike plates", assetPlates },
+	{ "coin", assetCoin },
+	{ "arial.ttf", assetFont },
+};
+
+void assetRequire (int id)
+{
+	Asset& asset = assets[id];
+	asset.requests++;
+	if (asset.loaded)
+		return;
+
+	PROFILE_ZONE("assetRequire");
+	long long start = nowNanos();
+	// Assets outlive the level that happened to need them first
+	int scope = registry.scope;
+	resourceScope(SCOPE_GLOBAL);
+	asset.create();
+	resourceScope(scope);
+	asset.loaded = true;
+	asset.load_nanos = nowNanos() - start;
+	asset.loaded_at = start - asset_epoch;
+}
+
+void assetReport (const char* when)
+{
+	logPrint(LOG_INFO, "Assets %s:", when);
+	for (int i=0; i<ASSET_COUNT; i++) {
+		const Asset& asset = assets[i];
+		if (asset.loaded)
+			logPrint(LOG_INFO, "  %-14s loaded at %lld ms in %.2f ms", asset.name, asset.loaded_at/1000000, asset.load_nanos/1e6);
+		else
+			logPrint(LOG_INFO, "  %-14s not loaded", asset.name);
+	}
+	char line[LOG_TEXT_SIZE] = "";
+	int length = 0, unused = 0;
+	for (int i=0; i<ASSET_COUNT; i++)
+		if (!assets[i].requests) {
+			length += snprintf(line + length, sizeof(line) - length, " %s", assets[i].name);
+			unused++;
+		}
+	logPrint(LOG_INFO, "  never used:%s", unused ? line : " none");
+}
+
+/* Static part of a level, built by platform() and shared read only with the
+   render thread through the snapshots */
+struct LevelLayout {
+	int level;
+	ArenaArray<glm::vec3> tiles; // block1
+	ArenaArray<glm::vec3> sand_tiles; // by layer, each layer's tiles together
+	int sand_layer_count[TILE_TEXTURE_LAYERS];
+	ArenaArray<glm::vec3> walls; // block3
+	ArenaArray<float> wall_heights;
+	ArenaArray<glm::vec3> plates; // block4
+	int coin_count;
+	bool has_key, has_lift;
+	glm::vec3 key, lift;
+
+	// Backs the arrays above and the simulation's per level arrays,
+	// released when the last snapshot holding the level lets go of it
+	Arena arena;
+	~LevelLayout () { arenaReset(arena); }
+};
+
+std::shared_ptr<const LevelLayout> level_layout;
+
+/* Everything the renderer needs from one simulation tick */
+struct RenderSnapshot {
+	std::shared_ptr<const LevelLayout> layout;
+	unsigned long tick;
+
+	glm::vec3 player;
+	float player_angle;
+	int view;
+	float camera_angle, camera_z;
+	bool dragging; // right button held, for late latching
+	double drag_x;
 
+	float lift_z;
+	bool key_visible;
+	float coin_angle;
+	vector<glm::vec3> coins;
+	vector<float> spike_heights;
 
+	int score, life, health, level;
+};
 
-			score += 10;	
+/* Lock free triple buffer. The simulation fills slots[back] and swaps it with
+   the middle slot, the renderer swaps its slots[front] with the middle slot
+   whenever that holds a snapshot it has not seen yet */
+#define SNAPSHOT_FRESH 4
 
-			cout<< "Score = "<<score<<endl;	
+struct SnapshotBuffer {
+	RenderSnapshot slots[3];
+	int back; // simulation thread only
+	int front; // render thread only
+	std::atomic<int> middle;
+} snapshots;
 
+unsigned long sim_tick = 0;
 
-			
-		}
+void publishSnapshot ()
+{
+	RenderSnapshot& snap = snapshots.slots[snapshots.back];
+	snap.layout = level_layout;
+	snap.tick = sim_tick;
+	snap.player = glm::vec3(x_b, y_b, z_b);
+	snap.player_angle = rotateangle;
+	snap.view = view;
+	snap.camera_angle = angle;
+	snap.camera_z = z_c;
+	snap.dragging = rmos;
+	snap.drag_x = drag_x;
+	snap.lift_z = u_z;
+	snap.key_visible = got_key == 0;
+	snap.coin_angle = rotatangle;
+	// assign() keeps the capacity of the slot, so only the first ticks allocate
+	snap.coins.assign(block5.begin(), block5.end());
+	snap.spike_heights.assign(spike_height.begin(), spike_height.end());
+	snap.score = score;
+	snap.life = life;
+	snap.health = health;
+	snap.level = level;
+
+	snapshots.back = snapshots.middle.exchange(snapshots.back | SNAPSHOT_FRESH) & 3;
+	latencyTickPublished(sim_tick);
+}
 
-		Matrices.model = glm::mat4(1.0f);
-		glm::mat4 translateRectangl = glm::translate (block5[i]);
-		glm::mat4 rotatecoin = glm::rotate((float)(rotatangle),glm::vec3(0,0,1));
-		Matrices.model *=  (translateRectangl * rotatecoin);
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		draw3DObject(coin);
+/* Returns false when no newer snapshot has been published since the last call */
+bool acquireSnapshot ()
+{
+	if (!(snapshots.middle & SNAPSHOT_FRESH))
+		return false;
+	snapshots.front = snapshots.middle.exchange(snapshots.front) & 3;
+	return true;
+}
 
+/* One instanced draw: consecutive instances of a mesh in the same pass,
+   their MVPs packed together in the stream buffer */
+struct DrawBatch {
+	MeshHandle mesh;
+	int pass;
+	GLintptr offset;
+	int count;
+};
 
+/* The instances of one kind of block. draw() reserves a stream buffer slot
+   for every block before the culling jobs run; a job packs the MVPs of its
+   visible blocks to the front of its own slots and starts a batch at the
+   slot where each run of one mesh begins, the other batch slots get count
+   0. So the GL thread only walks the batches and draws. The batch arrays
+   are made in the frame scratch at the start of every draw() */
+struct PacketList {
+	int pass;
+	glm::mat4* instances; // NULL when the stream buffer had no room
+	GLintptr offset; // of instances in the stream buffer
+	ArenaArray<DrawBatch> batches; // a slot per block, like instances
+};
 
-	}
+PacketList block1_packets, block3_packets, block4_packets, block5_packets, sand_packets;
 
+struct PacketBuild {
+	const ArenaArray<glm::vec3>* positions;
+	ArenaArray<MeshHandle>* meshes;
+	PacketList* packets;
+	glm::vec3 bounds_min, bounds_max; // Model space box around one block
+} block1_build, block3_build, sand_build;
 
+const RenderSnapshot* frame_snapshot;
+glm::mat4 frame_VP;
+glm::vec4 frame_planes[6];
 
-	if(p==1){
+/* Frustum planes of the current view projection (Gribb & Hartmann) */
+void extractFrustum (const glm::mat4& m)
+{
+	for (int i=0; i<3; i++) {
+		glm::vec4 row (m[0][i], m[1][i], m[2][i], m[3][i]);
+		glm::vec4 w (m[0][3], m[1][3], m[2][3], m[3][3]);
+		frame_planes[2*i] = w + row;
+		frame_planes[2*i + 1] = w - row;
+	}
+}
 
-		x_b =  x_b - cos(rotateangle)*movement*vel;
-		y_b =  y_b - sin(rotateangle)*movement*vel;
-		z_b = 20;
-		p = 0;
+bool boxVisible (glm::vec3 lo, glm::vec3 hi)
+{
+	for (int i=0; i<6; i++) {
+		const glm::vec4& plane = frame_planes[i];
+		// Corner furthest along the plane normal
+		float d = plane.x * (plane.x > 0 ? hi.x : lo.x)
+				+ plane.y * (plane.y > 0 ? hi.y : lo.y)
+				+ plane.z * (plane.z > 0 ? hi.z : lo.z) + plane.w;
+		if (d < 0)
+			return false;
 	}
-	if(p==2 ){
+	return true;
+}
 
-		z_b += -2;
+void packetListReserve (PacketList& list, int pass, int count)
+{
+	list.pass = pass;
+	list.instances = (glm::mat4*) streamAlloc(count*sizeof(glm::mat4), list.offset);
+	list.batches = frameArray<DrawBatch>(count);
+}
+
+/* A job's slots [begin,end) of a packet list, filled front to back */
+struct PacketRun {
+	PacketList* list;
+	int next, end;
+	DrawBatch* batch; // the run being extended, NULL before the first instance
+};
+
+PacketRun packetRun (PacketList& list, int begin, int end)
+{
+	PacketRun run = { &list, begin, end, NULL };
+	return run;
+}
 
+void packetAdd (PacketRun& run, MeshHandle mesh, const glm::mat4& MVP)
+{
+	PacketList& list = *run.list;
+	if (!list.instances)
+		return;
+	list.instances[run.next] = MVP;
+	DrawBatch& slot = list.batches[run.next];
+	if (run.batch && run.batch->mesh.slot == mesh.slot && run.batch->mesh.generation == mesh.generation) {
+		run.batch->count++;
+		slot.count = 0;
 	}
+	else {
+		slot.mesh = mesh;
+		slot.pass = list.pass;
+		slot.offset = list.offset + run.next*sizeof(glm::mat4);
+		slot.count = 1;
+		run.batch = &slot;
+	}
+	run.next++;
+}
 
-	if(z_b < -300 ) {
+/* The slots of culled blocks draw nothing */
+void packetRunEnd (PacketRun& run)
+{
+	if (run.list->instances)
+		for (int i=run.next; i<run.end; i++)
+			run.list->batches[i].count = 0;
+}
 
-		x_b = 80;
-		y_b = -80;
-		z_b = 20;
-		rotateangle = M_PI/2;
-		p = 0;
-		life--;
-		cout<< "lost life ;" <<" "<< "life = "<<" "<< life<<endl;
+void jobBuildTilePackets (void* data, int begin, int end)
+{
+	PROFILE_ZONE("cull tiles");
+	PacketBuild* build = (PacketBuild*) data;
+	PacketRun run = packetRun(*build->packets, begin, end);
+	for( int i=begin;i < end;i++){
+		const glm::vec3& position = (*build->positions)[i];
+		if (boxVisible(position + build->bounds_min, position + build->bounds_max))
+			packetAdd(run, (*build->meshes)[i], frame_VP * glm::translate (position));
 	}
+	packetRunEnd(run);
+}
 
-	if(p == 3 ) {
+/* Spike plates - the plate, four holes and four pyramids each */
+void jobBuildPlatePackets (void* data, int begin, int end)
+{
+	PROFILE_ZONE("cull plates");
+	static const glm::vec3 corners[4] = { glm::vec3(2,2,0), glm::vec3(2,-2,0), glm::vec3(-2,2,0), glm::vec3(-2,-2,0) };
+
+	const ArenaArray<glm::vec3>& plates = frame_snapshot->layout->plates;
+	// Plates, then all holes, then all pyramids, so each mesh draws as one batch
+	int count = plates.size();
+	PacketRun plate_run = packetRun(block4_packets, begin, end);
+	PacketRun hole_run = packetRun(block4_packets, count + 4*begin, count + 4*end);
+	PacketRun pyramid_run = packetRun(block4_packets, 5*count + 4*begin, 5*count + 4*end);
+	for( int i=begin;i < end;i++){
+		if (!boxVisible(plates[i] + glm::vec3(-5,-5,-9), plates[i] + glm::vec3(5,5,10.1)))
+			continue;
+
+		glm::mat4 translateRectangle2 = glm::translate (plates[i]);
+		packetAdd(plate_run, plate, frame_VP * translateRectangle2);
+		for (int j=0; j<4; j++) {
+			packetAdd(hole_run, plate_holes, frame_VP * translateRectangle2 * glm::translate(corners[j] + glm::vec3(0,0,0.1)));
+			packetAdd(pyramid_run, pyramid, frame_VP * translateRectangle2 * glm::translate(corners[j] + glm::vec3(0,0,frame_snapshot->spike_heights[i])));
+		}
+	}
+	packetRunEnd(plate_run);
+	packetRunEnd(hole_run);
+	packetRunEnd(pyramid_run);
+}
 
-		x_b = 80;
-		y_b = -80;
-		z_b = 20;
-		rotateangle = M_PI/2;
-		p = 0;
-		health += -20;
+void jobBuildCoinPackets (void* data, int begin, int end)
+{
+	PROFILE_ZONE("cull coins");
+	const vector<glm::vec3>& coins = frame_snapshot->coins;
+	glm::mat4 rotatecoin = glm::rotate((float)(frame_snapshot->coin_angle),glm::vec3(0,0,1));
+	PacketRun run = packetRun(block5_packets, begin, end);
+	for( int i=begin;i < end;i++)
+		if (boxVisible(coins[i] - glm::vec3(2.5,2.5,0), coins[i] + glm::vec3(2.5,2.5,0)))
+			packetAdd(run, coin, frame_VP * glm::translate (coins[i]) * rotatecoin);
+	packetRunEnd(run);
+}
 
-		if ( health <= 0){
-			health = 100;
-			life--;
-			cout<< "lost life ;" <<" "<< "life = "<<" "<< life<<endl;
+/* The few instances outside the packet lists (lift, key, player) */
+ArenaArray<DrawBatch> frame_batches;
+int batch_count;
+
+void queueInstance (int pass, MeshHandle mesh, const glm::mat4& MVP)
+{
+	GLintptr offset;
+	glm::mat4* instance = (glm::mat4*) streamAlloc(sizeof(glm::mat4), offset);
+	if (!instance)
+		return;
+	*instance = MVP;
+#ifdef GL_CALL_STATS
+	gl_stats.frame.bytes += sizeof(glm::mat4);
+#endif
+
+	if (batch_count > 0) {
+		DrawBatch& last = frame_batches[batch_count - 1];
+		if (last.pass == pass && last.mesh.slot == mesh.slot && last.mesh.generation == mesh.generation
+			&& last.offset + last.count*sizeof(glm::mat4) == offset) {
+			last.count++;
+			return;
 		}
+	}
+	DrawBatch& batch = frame_batches[batch_count++];
+	batch.mesh = mesh;
+	batch.pass = pass;
+	batch.offset = offset;
+	batch.count = 1;
+}
 
-		cout << "health = "<<health<<endl;
-		
+void drawPackets (const PacketList& list)
+{
+	if (!list.instances)
+		return;
+	for (int i=0; i<list.batches.size(); i++) {
+		const DrawBatch& batch = list.batches[i];
+		if (batch.count == 0)
+			continue;
+		draw3DObject(batch.mesh, batch.offset, batch.count);
+#ifdef GL_CALL_STATS
+		gl_stats.frame.bytes += batch.count*sizeof(glm::mat4);
+#endif
 	}
-	if (jump == 1 & p!= 2 & p!=5){
+}
 
-		v -= 0.1; 
-		z_b += v;
-		if(z_b <= 20){
-			z_b = 20;
-			jump = 0;
-		}
+void drawBatches (int pass)
+{
+	const PacketList* lists[] = { &block1_packets, &block3_packets, &sand_packets, &block4_packets, &block5_packets };
+	for (int i=0; i<5; i++)
+		if (lists[i]->pass == pass)
+			drawPackets(*lists[i]);
+	for (int i=0; i<batch_count; i++)
+		if (frame_batches[i].pass == pass)
+			draw3DObject(frame_batches[i].mesh, frame_batches[i].offset, frame_batches[i].count);
+}
+
+/* Render the scene with openGL */
+/* Edit this function according to your assignment */
+void draw (const RenderSnapshot& snap)
+{
+	PROFILE_ZONE("draw");
+	const LevelLayout& layout = *snap.layout;
+	float x_b = snap.player.x, y_b = snap.player.y, z_b = snap.player.z;
+	float rotateangle = snap.player_angle, angle = snap.camera_angle, z_c = snap.camera_z;
+	resetBoundState();
 
+	// Late latch: finish the camera drag with the newest cursor position
+	if (late_latch && snap.dragging)
+		angle+= (latest_cursor_x - snap.drag_x)*(M_PI)/300;
 
-	} 
+	gpuTimersBeginFrame();
+
+	// clear the color and depth in the frame buffer
+	glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	// Each mesh picks its shader variant when drawn, see useShader()
+	// Eye - Location of camera. Don't change unless you are sure!!
+
+	switch (snap.view) {
+			case 1:
+				Matrices.view = glm::lookAt(glm::vec3(0.0000001,0,300), glm::vec3(0,0,0), glm::vec3(0,0,1));
+				break;
+			case 2:
+				Matrices.view = glm::lookAt(glm::vec3(180*1.414*cos(angle),-180*1.414*sin(angle),z_c), glm::vec3(0,0,0), glm::vec3(0,0,1)); 
+				break;
+			case 3:
+				Matrices.view = glm::lookAt(glm::vec3(200,0,200), glm::vec3(0,0,0), glm::vec3(0,0,1));
+				break;
+			case 4:
+				Matrices.view = glm::lookAt(glm::vec3(x_b+7*cos(rotateangle),y_b+7*sin(rotateangle),z_b+10), glm::vec3(x_b+cos(rotateangle)*40,y_b+sin(rotateangle)*40,z_b), glm::vec3(0,0,1));
+				break;
+
+			case 5:
+				Matrices.view = glm::lookAt(glm::vec3(x_b-20*cos(rotateangle),y_b-20*sin(rotateangle),z_b+30), glm::vec3(x_b+cos(rotateangle)*40,y_b+sin(rotateangle)*40,z_b+5), glm::vec3(0,0,1));
+				break;
+			
+			}
+
+	//  Don't change unless you are sure!!
+	glm::mat4 VP = Matrices.projection * Matrices.view;
+
+	// Culling, MVP computation (MVP = Projection * View * Model) and batching
+	// run on the job threads, straight into the slots reserved in the stream
+	// buffer here. GL calls stay on this one
+	frame_snapshot = &snap;
+	frame_VP = VP;
+	extractFrustum(VP);
+	streamBeginFrame();
+	packetListReserve(block1_packets, PASS_TILES, layout.tiles.size());
+	packetListReserve(block3_packets, PASS_TILES, layout.walls.size());
+	packetListReserve(sand_packets, PASS_TILES, layout.sand_tiles.size());
+	packetListReserve(block4_packets, PASS_HAZARDS, 9*layout.plates.size());
+	packetListReserve(block5_packets, PASS_COINS, snap.coins.size());
+	jobGraphReset(draw_graph);
+	jobParallelFor(draw_graph, jobBuildTilePackets, &block1_build, layout.tiles.size(), 32);
+	jobParallelFor(draw_graph, jobBuildTilePackets, &block3_build, layout.walls.size(), 32);
+	jobParallelFor(draw_graph, jobBuildTilePackets, &sand_build, layout.sand_tiles.size(), 32);
+	jobParallelFor(draw_graph, jobBuildPlatePackets, NULL, layout.plates.size(), 8);
+	jobParallelFor(draw_graph, jobBuildCoinPackets, NULL, snap.coins.size(), 32);
+	jobRun(draw_graph);
+
+	// The rest of the frame's MVPs go into the stream buffer too, then the
+	// batches are drawn pass by pass
+	frame_batches = frameArray<DrawBatch>(3);
+	batch_count = 0;
+
+	if(snap.level!=0 && layout.has_lift){
+		Matrices.model = glm::mat4(1.0f);
+		glm::mat4 translatelift = glm::translate(glm::vec3(layout.lift.x,layout.lift.y,snap.lift_z));
+		Matrices.model *=  (translatelift );
+		queueInstance(PASS_TILES, u, VP * Matrices.model);
+    }
+
+	if(snap.key_visible && snap.level !=0 && layout.has_key){
+
+
+		Matrices.model = glm::mat4(1.0f);
+		glm::mat4 translatekey = glm::translate(layout.key);
+		Matrices.model *=  (translatekey );
+		queueInstance(PASS_COINS, k, VP * Matrices.model);
+	}
 
-	
 	Matrices.model = glm::mat4(1.0f);
 	glm::mat4 translateRectangle = glm::translate (glm::vec3(x_b,y_b,z_b));
 	glm::mat4 rotaterect = glm::rotate((float)(rotateangle),glm::vec3(0,0,1));
 	Matrices.model *=  (translateRectangle * rotaterect);
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	draw3DObject(box);
+	queueInstance(PASS_PLAYER, box, VP * Matrices.model);
+
+	// The HUD, rebuilt only where a value changed, and the overlay text join
+	// the stream buffer too
+	hudSet(HUD_LEVEL, snap.level);
+	hudSet(HUD_SCORE, snap.score);
+	hudSet(HUD_LIFE, snap.life);
+	hudSet(HUD_HEALTH, snap.health);
+	hudQueue();
+	if (show_gpu_timings)
+		drawGpuTimings();
+	textStream();
+
+	streamEndWrites();
+
+	for (int pass=PASS_TILES; pass<=PASS_PLAYER; pass++) {
+		gpuPassBegin(pass);
+		drawBatches(pass);
+	}
 
-	
+	// All the text of the frame is one draw
+	gpuPassBegin(PASS_TEXT);
+	textBegin();
+	textFlush();
+	textEnd();
 
+	gpuTimersEndFrame();
+	streamEndFrame();
 }
 
 /* Initialise glfw window, I/O callbacks and the renderer to use */
@@ -1281,10 +5141,26 @@ GLFWwindow* initGLFW (int width, int height)
 
 	/* Register function to handle mouse click */
 	glfwSetMouseButtonCallback(window, mouseButton);  // mouse button clicks
+	glfwSetCursorPosCallback(window, cursorPosition);
+	glfwSetScrollCallback(window, scroll_callback);
 
 	return window;
 }
 
+/* Uniform and attribute locations, again whenever a program is built or reloaded */
+void programLocations ()
+{
+	// Get a handle for our "MVP" uniform; instanced variants take theirs
+	// per instance from the stream buffer instead, see draw3DObject()
+	for (int i=0; i<(1 << FEATURE_COUNT); i++) {
+		ShaderVariant& variant = shader_variants[i];
+		if (!variant.program)
+			continue;
+		variant.MatrixID = glGetUniformLocation(variant.program, "MVP");
+		variant.ColorID = glGetUniformLocation(variant.program, "uniformColor");
+	}
+}
+
 /* Initialize the OpenGL rendering properties */
 /* Add all the models to be created here */
 void initGL (GLFWwindow* window, int width, int height)
@@ -1292,36 +5168,22 @@ void initGL (GLFWwindow* window, int width, int height)
 	// Load Textures
 	// Enable Texture0 as current texture memory
 	glActiveTexture(GL_TEXTURE0);
-	// load an image file directly as a new OpenGL texture
-	// GLuint texID = SOIL_load_OGL_texture ("beach.png", SOIL_LOAD_AUTO, SOIL_CREATE_NEW_ID, SOIL_FLAG_TEXTURE_REPEATS); // Buggy for OpenGL3
-	GLuint textureID = createTexture("beach2.png");
-	// check for an error during the load process
-	if(textureID == 0 )
-		cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
-
-	// Create and compile our GLSL program from the texture shaders
-	textureProgramID = LoadShaders( "TextureRender.vert", "TextureRender.frag" );
-	// Get a handle for our "MVP" uniform
-	Matrices.TexMatrixID = glGetUniformLocation(textureProgramID, "MVP");
-
-
-	/* Objects should be created before any other gl function and shaders */
-	// Create the models
-	createTriangle (); // Generate the VAO, VBOs, vertices data & copy into the array buffer
-	createRectangle (textureID);
-	
-	createplate();
-	createplate_holes();
-	createpyramid();
-	createcoin(1000,0,0,0,2.5);
-	
 
+	// Start the shader build first, the driver compiles while we load the
+	// rest. Other variants are built along with the assets that use them
+	asset_epoch = nowNanos();
+	shaderBuildInit();
+	submitShaderVariant(SCENE_SHADER);
+	submitShaderVariant(TEXT_SHADER);
 
+	// Ring buffer the per instance MVPs are streamed through
+	streamInit();
+	// Textures are decoded on a worker and uploaded a little every frame,
+	// see textureStreamFrame()
+	textureStreamInit();
 
-	// Create and compile our GLSL program from the shaders
-	programID = LoadShaders( "Sample_GL3.vert", "Sample_GL3.frag" );
-	// Get a handle for our "MVP" uniform
-	Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+	// Models and textures are made when a level needs them, see assetRequire()
+	pollShaderBuilds(false);
 
 
 	reshapeWindow (window, width, height);
@@ -1335,180 +5197,374 @@ void initGL (GLFWwindow* window, int width, int height)
 	//glEnable(GL_BLEND);
 	//glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-	// Initialise FTGL stuff
-	const char* fontfile = "arial.ttf";
-	GL3Font.font = new FTExtrudeFont(fontfile); // 3D extrude style rendering
+	// The HUD is on from the first frame, load its font now rather than in one
+	assetRequire(ASSET_FONT);
 
-	if(GL3Font.font->Error())
+	// Everything else is loaded, wait for the programs still building
 	{
-		cout << "Error: Could not load font `" << fontfile << "'" << endl;
-		glfwTerminate();
-		exit(EXIT_FAILURE);
+		PROFILE_ZONE("wait for shaders");
+		pollShaderBuilds(true);
 	}
 
-	// Create and compile our GLSL program from the font shaders
-	fontProgramID = LoadShaders( "fontrender.vert", "fontrender.frag" );
-	GLint fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform;
-	fontVertexCoordAttrib = glGetAttribLocation(fontProgramID, "vertexPosition");
-	fontVertexNormalAttrib = glGetAttribLocation(fontProgramID, "vertexNormal");
-	fontVertexOffsetUniform = glGetUniformLocation(fontProgramID, "pen");
-	GL3Font.fontMatrixID = glGetUniformLocation(fontProgramID, "MVP");
-	GL3Font.fontColorID = glGetUniformLocation(fontProgramID, "fontColor");
+	programLocations();
 
-	GL3Font.font->ShaderLocations(fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform);
-	GL3Font.font->FaceSize(1);
-	GL3Font.font->Depth(0);
-	GL3Font.font->Outset(0, 0);
-	GL3Font.font->CharMap(ft_encoding_unicode);
+	gpuTimersInit();
+	assetReport("after startup");
 
-	cout << "VENDOR: " << glGetString(GL_VENDOR) << endl;
-	cout << "RENDERER: " << glGetString(GL_RENDERER) << endl;
-	cout << "VERSION: " << glGetString(GL_VERSION) << endl;
-	cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
+	logPrint(LOG_INFO, "VENDOR: %s", (const char*) glGetString(GL_VENDOR));
+	logPrint(LOG_INFO, "RENDERER: %s", (const char*) glGetString(GL_RENDERER));
+	logPrint(LOG_INFO, "VERSION: %s", (const char*) glGetString(GL_VERSION));
+	logPrint(LOG_INFO, "GLSL: %s", (const char*) glGetString(GL_SHADING_LANGUAGE_VERSION));
 
 }
+ArenaArray<float> block3_height;
+
+/* Load the level file into the simulation state and publish its layout.
+   Runs on the simulation thread, meshes are made by createLevelMeshes() */
 void  platform(){
+	PROFILE_ZONE("platform");
 
 	string line;
-	float y=20,x;
-	ifstream file;
 	stringstream val;
 	string add;
 	add = ".txt";
 	val << level;
 
-	cout<<"level = "<<level<<endl;
+	logPrint(LOG_INFO, "level = %d", level);
 
 	angle = (M_PI)/4;
 	view = 2;
 	z_c = 200;
-	get =0;
+	got_key =0;
 
 	rotateangle = M_PI/2; 
 
 	string final =  val.str()+add;
-	file.open(final.c_str());
-
-	arr_block1.clear();
-	arr_block3.clear();
-
-	block1.clear();
-	block2.clear();
-	block3.clear();
-	block4.clear();
-	block5.clear();
-
-	float cl[2][3];
-	cl[0][0]=33;
-	cl[0][1]=102;
-	cl[0][2]=0;
-	cl[1][0]=101;
-	cl[1][1]=255;
-	cl[1][2]=26;
+	istringstream file(readFile(final.c_str()));
 
-	float cl2[2][3];
-	cl2[0][0]=33;
-	cl2[0][1]=102;
-	cl2[0][2]=100;
-	cl2[1][0]=33;
-	cl2[1][1]=102;
-	cl2[1][2]=0;
+	// Levels are at most 20 columns by 21 rows, y runs from 20 down to 0
+	char grid[21][21];
+	int rows = 0;
+	while(getline(file, line) && rows < 21)
+	{
+		strncpy(grid[rows], line.c_str(), 20);
+		grid[rows][20] = 0;
+		rows++;
+	}
 
-	
+	// Count every kind first so each array is a single arena allocation
+	int tiles = 0, holes = 0, walls = 0, plates = 0, coins = 0;
+	int sand[TILE_TEXTURE_LAYERS] = {};
+	for (int r=0; r<rows; r++)
+		for (int x=0; grid[r][x]; x++)
+			switch(grid[r][x])
+			{
+				case 't': sand[(x + r) % TILE_TEXTURE_LAYERS]++; break;
+				case 'c': coins++; tiles++; break; // coins and the key sit on a tile
+				case 'k':
+				case 'x': tiles++; break;
+				case 'o': holes++; break;
+				case 'e':
+				case 'b': walls++; break;
+				case 'p': plates++; break;
+				default: break;
+			}
 
-	box = createCube(10,10,10,cl2);
+	LevelLayout* layout = new LevelLayout;
+	layout->level = level;
+	layout->has_key = false;
+	layout->has_lift = false;
+
+	Arena& arena = layout->arena;
+	// Sand tiles are sorted by layer so each layer draws as one batch
+	int sand_next[TILE_TEXTURE_LAYERS], sand_tiles = 0;
+	for (int i=0; i<TILE_TEXTURE_LAYERS; i++) {
+		layout->sand_layer_count[i] = sand[i];
+		sand_next[i] = sand_tiles;
+		sand_tiles += sand[i];
+	}
+	layout->sand_tiles = arenaArray<glm::vec3>(arena, sand_tiles);
+	block1 = arenaArray<glm::vec3>(arena, tiles);
+	block2 = arenaArray<glm::vec3>(arena, holes);
+	block3 = arenaArray<glm::vec3>(arena, walls);
+	block3_height = arenaArray<float>(arena, walls);
+	block4 = arenaArray<glm::vec3>(arena, plates);
+	block5 = arenaArray<glm::vec3>(arena, coins);
 
 	x_b = 80;
 	y_b = -80;
 	z_b = 20;
 
-	while(getline(file, line) && y >= 0)
+	tiles = holes = walls = plates = coins = 0;
+	for (int r=0; r<rows; r++)
 		{
-			//cout << "oh" << level << line << endl;
-			int x = 0;
-			while(x < line.length() && x < 20)
+			float y = 20 - r;
+			for (int x=0; grid[r][x]; x++)
 			{
-				switch(line[x])
+				switch(grid[r][x])
 				{
 					case 'x':
-						arr_block1.push_back(createCube(10,10,20,cl));
-						block1.push_back(glm::vec3(float(x*10)-100, y*10-100, 0));
+						block1[tiles++] = glm::vec3(float(x*10)-100, y*10-100, 0);
+						break;
+					case 't':
+						layout->sand_tiles[sand_next[(x + r) % TILE_TEXTURE_LAYERS]++] = glm::vec3(float(x*10)-100, y*10-100, 0);
 						break;
 					case 'o':			
-						block2.push_back(glm::vec3(float(x*10)-100, y*10-100, 0));
+						block2[holes++] = glm::vec3(float(x*10)-100, y*10-100, 0);
 						break;
 					case 'e':
-						arr_block3.push_back(createCube(10,10,35,cl));
-						block3.push_back(glm::vec3(float(x*10)-100, y*10-100, 0));
+						block3_height[walls] = 35;
+						block3[walls++] = glm::vec3(float(x*10)-100, y*10-100, 0);
 						break;
 					case 'p':			
-						block4.push_back(glm::vec3(float(x*10)-100, y*10-100, 20));
+						block4[plates++] = glm::vec3(float(x*10)-100, y*10-100, 20);
 						break;
 					case 'c':			
-						block5.push_back(glm::vec3(float(x*10)-100, y*10-100, 40));
-						arr_block1.push_back(createCube(10,10,20,cl));
-						block1.push_back(glm::vec3(float(x*10)-100, y*10-100, 0));
+						block5[coins++] = glm::vec3(float(x*10)-100, y*10-100, 40);
+						block1[tiles++] = glm::vec3(float(x*10)-100, y*10-100, 0);
 						break;
 					case 'k':
 						k_x = float(x*10)-100;
 						k_y = y*10-100;
 						k_z = 20;
-						k=createCube(4,4,4,cl2); 
-						arr_block1.push_back(createCube(10,10,20,cl));
-						block1.push_back(glm::vec3(float(x*10)-100, y*10-100, 0));
+						layout->has_key = true;
+						block1[tiles++] = glm::vec3(float(x*10)-100, y*10-100, 0);
 						break;
 					case 'u':
 						u_x = float(x*10)-100;
 						u_y = y*10-100;
 						u_z = 20.1;
-						u=createCubeLift();
+						layout->has_lift = true;
 						break;
 					case 'b':
-						arr_block3.push_back(createCube(10,10,25,cl));
-						block3.push_back(glm::vec3(float(x*10)-100, y*10-100, 0));
+						block3_height[walls] = 25;
+						block3[walls++] = glm::vec3(float(x*10)-100, y*10-100, 0);
 						break;
 
 
 					default:
 						break;
 				}
-
-				x++;
 			}
-			y--;
 		}
-	file.close();
 
+	layout->tiles = block1;
+	layout->walls = block3;
+	layout->wall_heights = block3_height;
+	layout->plates = block4;
+	layout->coin_count = block5.size();
+	layout->key = glm::vec3(k_x, k_y, k_z);
+	layout->lift = glm::vec3(u_x, u_y, u_z);
+
+	// Per block scratch for the simulation jobs
+	wall_hit = arenaArray<char>(arena, block3.size());
+	hole_hit = arenaArray<char>(arena, block2.size());
+	spike_hit = arenaArray<char>(arena, block4.size());
+	spike_height = arenaArray<float>(arena, block4.size());
+	for (int i=0; i<spike_height.size(); i++)
+		spike_height[i] = -9;
+	coin_hit = arenaArray<char>(arena, block5.size());
+
+	// Drops the previous level, its arena goes back to the pool once the
+	// render thread has moved on from it too
+	level_layout.reset(layout);
+}
 
+/* Render thread's per level arrays, reset when the next level is built */
+Arena render_level_arena;
 
+/* Create the meshes of a level on the render thread */
+void createLevelMeshes (const LevelLayout& layout)
+{
+	PROFILE_ZONE("createLevelMeshes");
 
+	// Free the previous level before making this one
+	resourceRelease(SCOPE_LEVEL);
+	resourceScope(SCOPE_LEVEL);
+	arenaReset(render_level_arena);
+	k = MeshHandle();
+	u = MeshHandle();
 
- 
-	
+	float cl[2][3];
+	cl[0][0]=33;
+	cl[0][1]=102;
+	cl[0][2]=0;
+	cl[1][0]=101;
+	cl[1][1]=255;
+	cl[1][2]=26;
 
-	cube = createCube(10,10,20,cl);
+	float cl2[2][3];
+	cl2[0][0]=33;
+	cl2[0][1]=102;
+	cl2[0][2]=100;
+	cl2[1][0]=33;
+	cl2[1][1]=102;
+	cl2[1][2]=0;
 
+	box = createCube(10,10,10,cl2);
+	cube = createCube(10,10,20,cl);
 
+	// Identical blocks share a mesh so they draw as instances of it
+	arr_block1 = arenaArray<MeshHandle>(render_level_arena, layout.tiles.size());
+	for (int i=0; i<layout.tiles.size(); i++)
+		arr_block1[i] = cube;
+	arr_block3 = arenaArray<MeshHandle>(render_level_arena, layout.walls.size());
+	for (int i=0; i<layout.walls.size(); i++) {
+		int same = 0;
+		while (same < i && layout.wall_heights[same] != layout.wall_heights[i])
+			same++;
+		arr_block3[i] = same < i ? arr_block3[same] : createCube(10,10,layout.wall_heights[i],cl);
+	}
+	// One mesh per layer, its texture coordinates pick the layer
+	if (layout.sand_tiles.size())
+		assetRequire(ASSET_TILE_TEXTURE);
+	arr_sand = arenaArray<MeshHandle>(render_level_arena, layout.sand_tiles.size());
+	for (int l=0, i=0; l<TILE_TEXTURE_LAYERS; l++) {
+		MeshHandle sand = layout.sand_layer_count[l] ? createTexturedCube(10,10,20,l,tile_texture) : MeshHandle();
+		for (int j=0; j<layout.sand_layer_count[l]; j++)
+			arr_sand[i++] = sand;
+	}
+	if (layout.plates.size())
+		assetRequire(ASSET_PLATES);
+	if (layout.coin_count)
+		assetRequire(ASSET_COIN);
+	if (layout.has_key)
+		k=createCube(4,4,4,cl2);
+	if (layout.has_lift)
+		u=createCubeLift();
+
+	block1_build.positions = &layout.tiles;
+	block1_build.meshes = &arr_block1;
+	block1_build.packets = &block1_packets;
+	block1_build.bounds_min = glm::vec3(-5,-5,0);
+	block1_build.bounds_max = glm::vec3(5,5,20);
+
+	block3_build.positions = &layout.walls;
+	block3_build.meshes = &arr_block3;
+	block3_build.packets = &block3_packets;
+	block3_build.bounds_min = glm::vec3(-5,-5,0);
+	block3_build.bounds_max = glm::vec3(5,5,35);
+
+	sand_build.positions = &layout.sand_tiles;
+	sand_build.meshes = &arr_sand;
+	sand_build.packets = &sand_packets;
+	sand_build.bounds_min = glm::vec3(-5,-5,0);
+	sand_build.bounds_max = glm::vec3(5,5,20);
+
+	resourceScope(SCOPE_GLOBAL);
+	resourceReport("after loading the level");
+	bufferPageReport();
 }
 
-int main (int argc, char** argv)
-{
-	int width = 600;
-	int height = 600;
+/***********
+ * Threads *
+ ***********/
 
-	GLFWwindow* window = initGLFW(width, height);
+/* Simulation runs at a fixed rate on its own thread and publishes a snapshot
+   per tick; the render thread owns the GL context and draws the newest one.
+   The main thread only polls window events */
 
-	initGL (window, width, height);
+#define SIM_TICK_US 16667 // 60 ticks a second, the rate the game was tuned at
 
-	double last_update_time = glfwGetTime(), current_time;
-	platform();
+std::atomic<bool> game_running(true);
 
+/* --hot-reload (Linux only): a watcher thread waits on inotify for the
+   shader files in the working directory being written or renamed over and
+   reads the new sources. Between frames the render thread rebuilds every
+   variant from them and swaps each program in once it has linked; one that
+   fails to build leaves the previous program in place */
 
-	/* Draw in loop */
-	while (!glfwWindowShouldClose(window)) {
+bool hot_reload = false;
+
+struct ShaderReload {
+	std::string vertex_source, fragment_source;
+};
+
+std::mutex reload_lock;
+ShaderReload pending_reload;
+bool reload_pending = false; // a newer edit replaces one still waiting
+
+#ifdef __linux__
+void shaderWatchThread ()
+{
+	profileThreadBegin("shader watch");
+	int fd = inotify_init1(IN_NONBLOCK);
+	if (fd < 0 || inotify_add_watch(fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		logPrint(LOG_WARN, "Could not watch the shader files, hot reload is off");
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	alignas(struct inotify_event) char buffer[4096];
+	while (game_running) {
+		struct pollfd pending = { fd, POLLIN, 0 };
+		if (poll(&pending, 1, 100) <= 0)
+			continue;
+		ssize_t length = read(fd, buffer, sizeof(buffer));
+		for (char* p = buffer; p < buffer + length; ) {
+			struct inotify_event* event = (struct inotify_event*) p;
+			p += sizeof(struct inotify_event) + event->len;
+			if (event->len == 0)
+				continue;
+
+			if (strcmp(event->name, SHADER_VERTEX_FILE) && strcmp(event->name, SHADER_FRAGMENT_FILE))
+				continue;
+			ShaderReload reload;
+			// The edited files, not the pack
+			reload.vertex_source = readLooseFile(SHADER_VERTEX_FILE);
+			reload.fragment_source = readLooseFile(SHADER_FRAGMENT_FILE);
+
+			std::lock_guard<std::mutex> lock(reload_lock);
+			pending_reload = reload;
+			reload_pending = true;
+		}
+	}
+	close(fd);
+}
+#endif
+
+/* Render thread, between frames */
+void hotReloadFrame ()
+{
+	ShaderReload reload;
+	bool pending;
+	{
+		std::lock_guard<std::mutex> lock(reload_lock);
+		pending = reload_pending;
+		if (pending)
+			std::swap(reload, pending_reload);
+		reload_pending = false;
+	}
+	// Rebuild every variant in use from the new sources
+	for (int i=0; pending && i<(1 << FEATURE_COUNT); i++)
+		if (shader_variants[i].submitted)
+			submitShaderVariant(i, reload.vertex_source, reload.fragment_source, shader_variants[i].program != 0);
+	// Without parallel compile finishing blocks, so do it right away
+	if (!shader_builds.empty())
+		pollShaderBuilds(!parallel_shader_compile);
+}
+
+void simulationThread ()
+{
+	profileThreadBegin("simulation");
+	std::chrono::steady_clock::time_point next_tick = std::chrono::steady_clock::now();
 
-		// OpenGL Draw commands
+	platform();
+	publishSnapshot();
+#ifdef ALLOC_AUDIT
+	int steady_ticks = 0; // ticks since the last level change
+#endif
 
+	while (game_running) {
+		{
+			// Everything that happened up to the start of this tick
+			ALLOC_AUDIT_FRAME(steady_ticks > 120);
+			processInput(std::chrono::duration_cast<std::chrono::nanoseconds>(next_tick.time_since_epoch()).count());
+		}
+#ifdef ALLOC_AUDIT
+		const LevelLayout* audited_layout = level_layout.get();
+#endif
 
 		if(p == 10){
 
@@ -1533,28 +5589,216 @@ int main (int argc, char** argv)
 			restart =0;
 		}
 
+#ifdef ALLOC_AUDIT
+		// A tick that loaded a level is not audited, nor are the next few
+		// while the snapshot arrays grow to fit it
+		steady_ticks = level_layout.get() == audited_layout ? steady_ticks + 1 : 0;
+#endif
+		{
+			ALLOC_AUDIT_FRAME(steady_ticks > 120);
+			simulate();
+			sim_tick++;
+			publishSnapshot();
+		}
+
+		next_tick += std::chrono::microseconds(SIM_TICK_US);
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (now - next_tick > std::chrono::milliseconds(250))
+			next_tick = now; // Fell far behind (debugger, suspend), don't try to catch up
+		PROFILE_ZONE("sleep");
+		std::this_thread::sleep_until(next_tick);
+	}
+}
+
+void renderThread (GLFWwindow* window)
+{
+	profileThreadBegin("render");
+	glfwMakeContextCurrent(window);
+	glfwSwapInterval( 1 );
+
+	std::shared_ptr<const LevelLayout> mesh_layout;
+#ifdef ALLOC_AUDIT
+	int steady_frames = 0; // frames since the last level change
+#endif
+
+	while (game_running) {
+		PROFILE_ZONE("frame");
+		acquireSnapshot();
+		const RenderSnapshot& snap = snapshots.slots[snapshots.front];
+		if (!snap.layout) {
+			// Nothing published yet
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+
+		if (snap.layout != mesh_layout) {
+			createLevelMeshes(*snap.layout);
+			mesh_layout = snap.layout;
+#ifdef ALLOC_AUDIT
+			steady_frames = 0;
+#endif
+		}
+		if (framebuffer_resized.exchange(false))
+			resizeViewport();
+		if (hot_reload)
+			hotReloadFrame();
+		textureStreamFrame();
+
+		long long draw_start, draw_end;
+		{
+			// Once a level has settled draw and swap must not allocate
+			ALLOC_AUDIT_FRAME(++steady_frames > 120);
+			frameReset();
+
+			draw_start = nowNanos();
+			draw(snap);
+			draw_end = nowNanos();
+
+			// Swap Frame Buffer in double buffering
+			PROFILE_ZONE("glfwSwapBuffers");
+			glfwSwapBuffers(window);
+		}
 
-		draw();
+		if (latency_mode)
+			latencyFrame(snap.tick, draw_start, draw_end, nowNanos());
 
-		// Swap Frame Buffer in double buffering
-		glfwSwapBuffers(window);
+#ifdef GL_CALL_STATS
+		glStatsEndFrame();
+		if (dump_gl_stats.exchange(false))
+			glStatsDump();
+#endif
+	}
 
-		// Poll for Keyboard and mouse events
-		glfwPollEvents();
+	resourceReport("at exit");
+	assetReport("at exit");
+	logPrint(LOG_INFO, "Frame scratch: %ld KB peak, %ld overflowing allocations", (long)(frame_scratch.peak/1024), (long)frame_scratch.overflows);
+	logPrint(LOG_INFO, "Text: %ld HUD element rebuilds, %ld lines cut short", hud.rebuilds, text_batch.dropped);
+	resourceRelease(SCOPE_LEVEL);
+	resourceRelease(SCOPE_GLOBAL);
+	glfwMakeContextCurrent(NULL);
+}
 
-		glfwGetCursorPos(window, &mos_x, &mos_y);
-		glfwSetScrollCallback(window, scroll_callback);
-  	
-  	    //glfwSetScrollCallback(window, scroll_callback);
+enum BakeMode { BAKE_NONE, BAKE_COMPRESSED, BAKE_UNCOMPRESSED };
+int bake = BAKE_NONE;
+bool use_pack = true;
 
-		// Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
-		current_time = glfwGetTime(); // Time in seconds
-		if ((current_time - last_update_time) >= 0.5) { // atleast 0.5s elapsed since last frame
-			// do something every 0.5 seconds ..
-			last_update_time = current_time;
+int main (int argc, char** argv)
+{
+	int width = 600;
+	int height = 600;
+	const char* log_path = NULL;
+
+	for (int i=1; i<argc; i++) {
+		if (!strcmp(argv[i], "--latency"))
+			latency_mode = true;
+		else if (!strcmp(argv[i], "--late-latch"))
+			late_latch = true;
+		else if (!strcmp(argv[i], "--gpu-timings"))
+			show_gpu_timings = true;
+		else if (!strcmp(argv[i], "--no-shader-cache"))
+			shader_cache = false;
+		else if (!strcmp(argv[i], "--hot-reload"))
+			hot_reload = true;
+		else if (!strcmp(argv[i], "--bake"))
+			bake = BAKE_COMPRESSED;
+		else if (!strcmp(argv[i], "--bake-uncompressed"))
+			bake = BAKE_UNCOMPRESSED;
+		else if (!strcmp(argv[i], "--pack"))
+			exit(packWrite(PACK_FILE) ? EXIT_SUCCESS : EXIT_FAILURE);
+		else if (!strcmp(argv[i], "--no-pack"))
+			use_pack = false;
+		else if (!strcmp(argv[i], "--trace") && i+1 < argc)
+			trace_path = argv[++i];
+		else if (!strcmp(argv[i], "--log") && i+1 < argc)
+			log_path = argv[++i];
+		else if (!strcmp(argv[i], "--log-level") && i+1 < argc) {
+			i++;
+			for (int l=0; l<LOG_LEVEL_COUNT; l++)
+				if (!strcmp(argv[i], log_level_names[l]))
+					log_level = l;
 		}
 	}
 
+	logInit(log_path);
+#ifndef __linux__
+	// Settled before the render thread starts reading it
+	if (hot_reload)
+		logPrint(LOG_WARN, "Shader hot reload needs inotify, it is only available on Linux");
+	hot_reload = false;
+#endif
+
+	if (trace_path) {
+		profiling = true;
+		profile_epoch = nowNanos();
+		profileThreadBegin("main");
+	}
+
+	if (use_pack)
+		packOpen(PACK_FILE);
+
+	GLFWwindow* window;
+	{
+		PROFILE_ZONE("initGLFW");
+		window = initGLFW(width, height);
+	}
+
+	if (bake) {
+		bool baked = bakeTextures(bake == BAKE_COMPRESSED);
+		glfwTerminate();
+		exit(baked ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	// Before initGL, it starts decoding textures on the workers
+	jobInit();
+
+	{
+		PROFILE_ZONE("initGL");
+		initGL (window, width, height);
+	}
+
+	// Hand the context over to the render thread
+	glfwMakeContextCurrent(NULL);
+
+	snapshots.back = 0;
+	snapshots.front = 1;
+	snapshots.middle = 2;
+
+	std::thread simulation(simulationThread);
+	std::thread renderer(renderThread, window);
+#ifdef __linux__
+	std::thread shader_watch;
+	if (hot_reload)
+		shader_watch = std::thread(shaderWatchThread);
+#endif
+
+	while (!glfwWindowShouldClose(window)) {
+		PROFILE_ZONE("events");
+		ALLOC_AUDIT_FRAME(true);
+
+		// Wait for Keyboard and mouse events
+		glfwWaitEvents();
+	}
+
+	game_running = false;
+	simulation.join();
+	renderer.join();
+#ifdef __linux__
+	if (shader_watch.joinable())
+		shader_watch.join();
+#endif
+
+	// The reports below print directly, after everything already logged
+	logFlush();
+	if (latency_mode)
+		latencyReport();
+#ifdef ALLOC_AUDIT
+	allocAuditReport();
+#endif
+
+	jobShutdown();
+	if (trace_path)
+		profileWriteTrace(trace_path);
+	glfwDestroyWindow(window);
 	glfwTerminate();
 	exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,34 @@
+// Built together with Scene.vert, with the same feature #defines
+
+// Interpolated values from the vertex shaders
+#if defined(TEXTURE_ARRAY)
+in vec3 fragTexCoord;
+
+// Layers of the level's tile textures
+uniform sampler2DArray texSampler;
+#elif defined(TEXTURED)
+in vec2 fragTexCoord;
+
+// Texture sample for the whole mesh
+uniform sampler2D texSampler;
+#endif
+#if defined(VERTEX_COLOR) || defined(UNIFORM_COLOR)
+in vec3 fragColor;
+#endif
+
+// output data, alpha only matters to text, which is blended
+out vec4 color;
+
+void main()
+{
+#if defined(SDF)
+    // 0.5 is the glyph outline, smooth it over about a pixel at any scale
+    float distance = texture( texSampler, fragTexCoord ).r;
+    float edge = fwidth(distance);
+    color = vec4(fragColor, smoothstep(0.5 - edge, 0.5 + edge, distance));
+#elif defined(TEXTURED)
+    color = vec4(texture( texSampler, fragTexCoord ).rgb, 1);
+#else
+    color = vec4(fragColor, 1);
+#endif
+}
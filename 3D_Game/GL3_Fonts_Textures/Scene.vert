@@ -0,0 +1,58 @@
+// Every program is built from this one source. The #version line and one
+// #define per feature are put in front by the game (see shaderVariantSource)
+//   VERTEX_COLOR   color per vertex
+//   UNIFORM_COLOR  one color for the whole draw
+//   TEXTURED       texture coordinates, sampled in Scene.frag
+//   TEXTURE_ARRAY  with TEXTURED, a third coordinate picks the array layer
+//   INSTANCED      MVP per instance instead of a uniform
+//   SDF            with TEXTURED, the texture is a glyph distance field (text)
+
+// input data : sent from main program
+layout (location = 0) in vec3 vertexPosition;
+#ifdef VERTEX_COLOR
+layout (location = 1) in vec3 vertexColor;
+#endif
+#if defined(TEXTURE_ARRAY)
+layout (location = 2) in vec3 vertexTexCoord;
+#elif defined(TEXTURED)
+layout (location = 2) in vec2 vertexTexCoord;
+#endif
+#ifdef INSTANCED
+// per instance, streamed every frame (takes locations 3 to 6)
+layout (location = 3) in mat4 MVP;
+#else
+uniform mat4 MVP;
+#endif
+#ifdef UNIFORM_COLOR
+uniform vec3 uniformColor;
+#endif
+
+// output data : used by fragment shader
+#if defined(TEXTURE_ARRAY)
+out vec3 fragTexCoord;
+#elif defined(TEXTURED)
+out vec2 fragTexCoord;
+#endif
+#if defined(VERTEX_COLOR) || defined(UNIFORM_COLOR)
+out vec3 fragColor;
+#endif
+
+void main ()
+{
+    vec4 v = vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
+
+    // The color or texture coord of each vertex will be interpolated
+    // to produce the color of each fragment
+#ifdef VERTEX_COLOR
+    fragColor = vertexColor;
+#endif
+#ifdef UNIFORM_COLOR
+    fragColor = uniformColor;
+#endif
+#ifdef TEXTURED
+    fragTexCoord = vertexTexCoord;
+#endif
+
+    // Output position of the vertex, in clip space : MVP * position
+    gl_Position = MVP * v;
+}